@@ -6,13 +6,25 @@ android|ios|tvos|winrt {
     error( "Couldn't find the examples.pri file!" )
 }
 
-QT += 3dcore 3drender 3dinput 3dextras
-QT += widgets
+QT += 3dcore 3drender 3dinput 3dlogic 3dextras
+QT += widgets concurrent
+
+CONFIG += c++17
 
 SOURCES += main.cpp \
-    scenemodifier.cpp
+    scenemodifier.cpp \
+    renderbatch.cpp
 
 HEADERS += \
-    scenemodifier.h
+    scenemodifier.h \
+    renderbatch.h
+
+# the live feed needs POSIX shared memory
+unix {
+    SOURCES += feedring.cpp
+    HEADERS += feedring.h
+    DEFINES += HAVE_LIVEFEED
+    !macx: LIBS += -lrt
+}
 
 
@@ -0,0 +1,247 @@
+/****************************************************************************
+**
+** Copyright (C) 2014 Klaralvdalens Datakonsult AB (KDAB).
+** Contact: https://www.qt.io/licensing/
+**
+** This file is part of the Qt3D module of the Qt Toolkit.
+**
+** $QT_BEGIN_LICENSE:BSD$
+** Commercial License Usage
+** Licensees holding valid commercial Qt licenses may use this file in
+** accordance with the commercial license agreement provided with the
+** Software or, alternatively, in accordance with the terms contained in
+** a written agreement between you and The Qt Company. For licensing terms
+** and conditions see https://www.qt.io/terms-conditions. For further
+** information use the contact form at https://www.qt.io/contact-us.
+**
+** BSD License Usage
+** Alternatively, you may use this file under the terms of the BSD license
+** as follows:
+**
+** "Redistribution and use in source and binary forms, with or without
+** modification, are permitted provided that the following conditions are
+** met:
+**   * Redistributions of source code must retain the above copyright
+**     notice, this list of conditions and the following disclaimer.
+**   * Redistributions in binary form must reproduce the above copyright
+**     notice, this list of conditions and the following disclaimer in
+**     the documentation and/or other materials provided with the
+**     distribution.
+**   * Neither the name of The Qt Company Ltd nor the names of its
+**     contributors may be used to endorse or promote products derived
+**     from this software without specific prior written permission.
+**
+**
+** THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+** "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+** LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+** A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+** OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+** SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+** LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+** DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+** THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+** (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+** OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE."
+**
+** $QT_END_LICENSE$
+**
+****************************************************************************/
+
+#include "feedring.h"
+
+#include <QtCore/QDebug>
+#include <QtCore/QThread>
+
+#include <atomic>
+#include <new>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static constexpr quint32 FEEDMAGIC = 0x42534652;
+
+//head and tail live on separate cache lines so producer and consumer do not share one
+struct FeedRing::Header
+{
+    quint32 magic;
+    quint32 capacity;
+    //the producer is started by the viewer, so it is orphaned once this is no longer its parent
+    qint64 viewer;
+    alignas(64) std::atomic<quint64> head;
+    alignas(64) std::atomic<quint64> tail;
+    alignas(64) std::atomic<quint64> frame;
+    std::atomic<quint64> stalls;
+    std::atomic<quint32> closed;
+    std::atomic<quint32> finished;
+};
+
+static_assert(std::atomic<quint64>::is_always_lock_free, "the ring is shared between processes and must not need a lock");
+
+FeedRing *FeedRing::Create(const QString &name, quint32 capacity)
+{
+    if(capacity == 0 || (capacity & (capacity - 1)) != 0)
+    {
+        qWarning() << "feed capacity must be a power of two:" << capacity;
+        return nullptr;
+    }
+
+    QByteArray path = name.toLocal8Bit();
+    int fd = shm_open(path.constData(), O_CREAT | O_TRUNC | O_RDWR, 0600);
+    if(fd < 0)
+    {
+        qWarning() << "cannot create feed" << name;
+        return nullptr;
+    }
+
+    size_t size = sizeof(Header) + capacity * sizeof(FeedRecord);
+    void *memory = MAP_FAILED;
+    if(ftruncate(fd, size) == 0)
+        memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if(memory == MAP_FAILED)
+    {
+        qWarning() << "cannot map feed" << name;
+        shm_unlink(path.constData());
+        return nullptr;
+    }
+
+    Header *header = new (memory) Header;
+    header->capacity = capacity;
+    header->viewer = getpid();
+    header->head = 0;
+    header->tail = 0;
+    header->frame = 0;
+    header->stalls = 0;
+    header->closed = 0;
+    header->finished = 0;
+    header->magic = FEEDMAGIC;
+
+    return new FeedRing(name, memory, size, true);
+}
+
+FeedRing *FeedRing::Open(const QString &name)
+{
+    QByteArray path = name.toLocal8Bit();
+    int fd = shm_open(path.constData(), O_RDWR, 0600);
+    if(fd < 0)
+    {
+        qWarning() << "cannot open feed" << name;
+        return nullptr;
+    }
+
+    struct stat info;
+    void *memory = MAP_FAILED;
+    if(fstat(fd, &info) == 0 && size_t(info.st_size) >= sizeof(Header))
+        memory = mmap(nullptr, info.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if(memory == MAP_FAILED)
+    {
+        qWarning() << "cannot map feed" << name;
+        return nullptr;
+    }
+
+    Header *header = static_cast<Header *>(memory);
+    if(header->magic != FEEDMAGIC ||
+       size_t(info.st_size) < sizeof(Header) + header->capacity * sizeof(FeedRecord))
+    {
+        qWarning() << "feed" << name << "is not a feed ring";
+        munmap(memory, info.st_size);
+        return nullptr;
+    }
+
+    return new FeedRing(name, memory, info.st_size, false);
+}
+
+FeedRing::FeedRing(const QString &name, void *memory, size_t size, bool owner)
+    : m_name(name), m_memory(memory), m_size(size), m_owner(owner)
+{
+    m_header = static_cast<Header *>(memory);
+    m_records = reinterpret_cast<FeedRecord *>(static_cast<char *>(memory) + sizeof(Header));
+}
+
+FeedRing::~FeedRing()
+{
+    munmap(m_memory, m_size);
+    if(m_owner)
+        shm_unlink(m_name.toLocal8Bit().constData());
+}
+
+bool FeedRing::Publish(const FeedRecord &record)
+{
+    const quint64 head = m_header->head.load(std::memory_order_relaxed);
+
+    //back-pressure: wait for the viewer instead of overwriting what it has not drawn yet
+    while(head - m_header->tail.load(std::memory_order_acquire) >= m_header->capacity)
+    {
+        if(m_header->closed.load(std::memory_order_acquire) || !ViewerAlive())
+            return false;
+        m_header->stalls.fetch_add(1, std::memory_order_relaxed);
+        QThread::usleep(200);
+    }
+
+    if(m_header->closed.load(std::memory_order_relaxed))
+        return false;
+
+    FeedRecord &slot = m_records[head & (m_header->capacity - 1)];
+    slot = record;
+    slot.frame = m_header->frame.load(std::memory_order_relaxed);
+    m_header->head.store(head + 1, std::memory_order_release);
+    return true;
+}
+
+void FeedRing::Finish()
+{
+    m_header->finished.store(1, std::memory_order_release);
+}
+
+bool FeedRing::ViewerAlive() const
+{
+    return getppid() == m_header->viewer;
+}
+
+void FeedRing::Unlink()
+{
+    shm_unlink(m_name.toLocal8Bit().constData());
+}
+
+const FeedRecord *FeedRing::Peek(quint32 &count, quint32 max) const
+{
+    const quint64 tail = m_header->tail.load(std::memory_order_relaxed);
+    const quint64 head = m_header->head.load(std::memory_order_acquire);
+    const quint32 index = tail & (m_header->capacity - 1);
+
+    //only the contiguous part, a wrapped ring needs a second Peek after Release
+    count = qMin<quint64>(qMin<quint64>(head - tail, max), m_header->capacity - index);
+    return m_records + index;
+}
+
+void FeedRing::Release(quint32 count)
+{
+    m_header->tail.fetch_add(count, std::memory_order_release);
+}
+
+void FeedRing::SetFrame(quint64 frame)
+{
+    m_header->frame.store(frame, std::memory_order_relaxed);
+}
+
+void FeedRing::Close()
+{
+    m_header->closed.store(1, std::memory_order_release);
+}
+
+bool FeedRing::Finished() const
+{
+    return m_header->finished.load(std::memory_order_acquire) &&
+           m_header->head.load(std::memory_order_acquire) == m_header->tail.load(std::memory_order_relaxed);
+}
+
+quint64 FeedRing::Stalls() const
+{
+    return m_header->stalls.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,106 @@
+/****************************************************************************
+**
+** Copyright (C) 2014 Klaralvdalens Datakonsult AB (KDAB).
+** Contact: https://www.qt.io/licensing/
+**
+** This file is part of the Qt3D module of the Qt Toolkit.
+**
+** $QT_BEGIN_LICENSE:BSD$
+** Commercial License Usage
+** Licensees holding valid commercial Qt licenses may use this file in
+** accordance with the commercial license agreement provided with the
+** Software or, alternatively, in accordance with the terms contained in
+** a written agreement between you and The Qt Company. For licensing terms
+** and conditions see https://www.qt.io/terms-conditions. For further
+** information use the contact form at https://www.qt.io/contact-us.
+**
+** BSD License Usage
+** Alternatively, you may use this file under the terms of the BSD license
+** as follows:
+**
+** "Redistribution and use in source and binary forms, with or without
+** modification, are permitted provided that the following conditions are
+** met:
+**   * Redistributions of source code must retain the above copyright
+**     notice, this list of conditions and the following disclaimer.
+**   * Redistributions in binary form must reproduce the above copyright
+**     notice, this list of conditions and the following disclaimer in
+**     the documentation and/or other materials provided with the
+**     distribution.
+**   * Neither the name of The Qt Company Ltd nor the names of its
+**     contributors may be used to endorse or promote products derived
+**     from this software without specific prior written permission.
+**
+**
+** THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+** "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+** LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+** A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+** OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+** SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+** LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+** DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+** THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+** (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+** OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE."
+**
+** $QT_END_LICENSE$
+**
+****************************************************************************/
+
+#ifndef FEEDRING_H
+#define FEEDRING_H
+
+#include <QtCore/QString>
+
+#include <cstddef>
+
+//one generated node together with the edge to its parent
+struct FeedRecord
+{
+    float center[3];
+    float parent[3];
+    float radius;
+    quint16 layer;
+    quint16 hasParent;
+    //viewer frame at the time the record was written, used to measure latency
+    quint64 frame;
+};
+
+//lock-free single producer / single consumer ring of FeedRecords in POSIX shared memory
+class FeedRing
+{
+public:
+    static FeedRing *Create(const QString &name, quint32 capacity);
+    static FeedRing *Open(const QString &name);
+    ~FeedRing();
+
+    //producer side, blocks while the ring is full and fails once the viewer closed it or died
+    bool Publish(const FeedRecord &record);
+    void Finish();
+    bool ViewerAlive() const;
+    //removes the segment name, for a producer left behind by a viewer that died without Close
+    void Unlink();
+
+    //consumer side, records are read in place and handed back with Release
+    const FeedRecord *Peek(quint32 &count, quint32 max) const;
+    void Release(quint32 count);
+    void SetFrame(quint64 frame);
+    void Close();
+    bool Finished() const;
+    quint64 Stalls() const;
+
+private:
+    struct Header;
+
+    FeedRing(const QString &name, void *memory, size_t size, bool owner);
+
+    QString m_name;
+    void *m_memory;
+    size_t m_size;
+    bool m_owner;
+    Header *m_header;
+    FeedRecord *m_records;
+};
+
+#endif // FEEDRING_H
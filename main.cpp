@@ -51,6 +51,8 @@
 #include "scenemodifier.h"
 
 #include <QGuiApplication>
+#include <QtCore/QCommandLineParser>
+#include <QtCore/QCoreApplication>
 
 #include <Qt3DRender/qcamera.h>
 #include <Qt3DCore/qentity.h>
@@ -61,6 +63,8 @@
 #include <QtWidgets/QHBoxLayout>
 #include <QtWidgets/QCheckBox>
 #include <QtWidgets/QCommandLinkButton>
+#include <QtWidgets/QLabel>
+#include <QtWidgets/QSpinBox>
 #include <QtGui/QScreen>
 
 #include <Qt3DInput/QInputAspect>
@@ -86,7 +90,41 @@
 
 int main(int argc, char **argv)
 {
+#ifdef HAVE_LIVEFEED
+    //generator processes started by the live feed never open a window
+    for (int i = 1; i + 1 < argc; ++i) {
+        if (qstrcmp(argv[i], "--feed-worker") == 0) {
+            QCoreApplication worker(argc, argv);
+            return SceneModifier::RunFeedWorker(QString::fromLocal8Bit(argv[i + 1]));
+        }
+    }
+#endif
+
     QApplication app(argc, argv);
+
+    QCommandLineParser parser;
+    parser.addHelpOption();
+    QCommandLineOption forestOption(QStringLiteral("forest"),
+                                    QStringLiteral("Generate a forest of <trees> independent trees."),
+                                    QStringLiteral("trees"));
+    parser.addOption(forestOption);
+    QCommandLineOption lazyOption(QStringLiteral("lazy"),
+                                  QStringLiteral("Grow the tree on demand around the camera."));
+    parser.addOption(lazyOption);
+    QCommandLineOption compactOption(QStringLiteral("compact"),
+                                     QStringLiteral("Keep the tree in the compact quantized encoding."));
+    parser.addOption(compactOption);
+    QCommandLineOption relaxOption(QStringLiteral("relax"),
+                                   QStringLiteral("Resolve overlaps by relaxation instead of re-rolling spheres."));
+    parser.addOption(relaxOption);
+#ifdef HAVE_LIVEFEED
+    QCommandLineOption feedOption(QStringLiteral("feed"),
+                                  QStringLiteral("Stream <trees> trees from generator processes."),
+                                  QStringLiteral("trees"));
+    parser.addOption(feedOption);
+#endif
+    parser.process(app);
+
     Qt3DExtras::Qt3DWindow *view = new Qt3DExtras::Qt3DWindow();
     view->defaultFrameGraph()->setClearColor(QColor(QRgb(0x4d4d4f)));
     QWidget *container = QWidget::createWindowContainer(view);
@@ -131,7 +169,24 @@ int main(int argc, char **argv)
     camController->setCamera(cameraEntity);
 
     // Scenemodifier
-    SceneModifier *modifier = new SceneModifier(rootEntity);
+    SceneModifier *modifier = parser.isSet(forestOption)
+            ? new SceneModifier(rootEntity, SceneModifier::Forest, qMax(1, parser.value(forestOption).toInt()),
+                                parser.isSet(relaxOption))
+#ifdef HAVE_LIVEFEED
+            : parser.isSet(feedOption)
+            ? new SceneModifier(rootEntity, SceneModifier::LiveFeed, qMax(1, parser.value(feedOption).toInt()),
+                                parser.isSet(relaxOption))
+#endif
+            : parser.isSet(lazyOption)
+            ? new SceneModifier(rootEntity, SceneModifier::LazyTree, 1, parser.isSet(relaxOption))
+            : parser.isSet(compactOption)
+            ? new SceneModifier(rootEntity, SceneModifier::CompactTree, 1, parser.isSet(relaxOption))
+            : new SceneModifier(rootEntity, SceneModifier::SingleTree, 1, parser.isSet(relaxOption));
+    //the destructor closes the feed rings and stops the generator processes
+    QObject::connect(&app, &QCoreApplication::aboutToQuit, [modifier]() { delete modifier; });
+    QObject::connect(cameraEntity, &Qt3DRender::QCamera::positionChanged,
+                     modifier, &SceneModifier::UpdateCamera);
+    modifier->UpdateCamera(cameraEntity->position());
 
     // Set root object of the scene
     view->setRootEntity(rootEntity);
@@ -145,6 +200,62 @@ int main(int argc, char **argv)
 
     vLayout->addWidget(info);
 
+    if (modifier->ShardCount() > 0) {
+        QCheckBox *forestCB = new QCheckBox(widget);
+        forestCB->setChecked(true);
+        forestCB->setText(QStringLiteral("Forest (%1 shards)").arg(modifier->ShardCount()));
+        vLayout->addWidget(forestCB);
+
+        QSpinBox *shardSB = new QSpinBox(widget);
+        shardSB->setRange(0, modifier->ShardCount() - 1);
+        shardSB->setPrefix(QStringLiteral("Shard "));
+        vLayout->addWidget(shardSB);
+
+        QCheckBox *shardCB = new QCheckBox(widget);
+        shardCB->setChecked(true);
+        shardCB->setText(QStringLiteral("Shard visible"));
+        vLayout->addWidget(shardCB);
+
+        QObject::connect(forestCB, &QCheckBox::toggled, [modifier, shardSB, shardCB](bool visible) {
+            modifier->SetAllShardsVisible(visible);
+            shardCB->setChecked(modifier->IsShardVisible(shardSB->value()));
+        });
+        QObject::connect(shardSB, QOverload<int>::of(&QSpinBox::valueChanged), [modifier, shardCB](int shard) {
+            shardCB->setChecked(modifier->IsShardVisible(shard));
+        });
+        QObject::connect(shardCB, &QCheckBox::clicked, [modifier, shardSB](bool visible) {
+            modifier->SetShardVisible(shardSB->value(), visible);
+        });
+    }
+
+    if (modifier->PackedNodeCount() > 0) {
+        QLabel *compactLabel = new QLabel(widget);
+        compactLabel->setText(QStringLiteral("%1 nodes, %2 bytes/node (pointer tree %3), max error %4")
+                              .arg(modifier->PackedNodeCount())
+                              .arg(modifier->PackedBytesPerNode(), 0, 'f', 1)
+                              .arg(modifier->PointerBytesPerNode(), 0, 'f', 0)
+                              .arg(modifier->PackedMaxError(), 0, 'g', 3));
+        vLayout->addWidget(compactLabel);
+    }
+
+    if (parser.isSet(relaxOption)) {
+        QLabel *relaxLabel = new QLabel(widget);
+        relaxLabel->setText(QStringLiteral("%1 overlapping spheres dropped").arg(modifier->RelaxDropped()));
+        vLayout->addWidget(relaxLabel);
+    }
+
+#ifdef HAVE_LIVEFEED
+    if (parser.isSet(feedOption)) {
+        QLabel *feedLabel = new QLabel(widget);
+        QObject::connect(modifier, &SceneModifier::FeedStats,
+                         [feedLabel](double nodesPerSecond, double latencyFrames, quint64 stalls) {
+            feedLabel->setText(QStringLiteral("%1 nodes/s, %2 frames latency, %3 stalls")
+                               .arg(nodesPerSecond, 0, 'f', 0).arg(latencyFrames, 0, 'f', 1).arg(stalls));
+        });
+        vLayout->addWidget(feedLabel);
+    }
+#endif
+
 
     // Show window
     widget->show();
@@ -0,0 +1,451 @@
+/****************************************************************************
+**
+** Copyright (C) 2014 Klaralvdalens Datakonsult AB (KDAB).
+** Contact: https://www.qt.io/licensing/
+**
+** This file is part of the Qt3D module of the Qt Toolkit.
+**
+** $QT_BEGIN_LICENSE:BSD$
+** Commercial License Usage
+** Licensees holding valid commercial Qt licenses may use this file in
+** accordance with the commercial license agreement provided with the
+** Software or, alternatively, in accordance with the terms contained in
+** a written agreement between you and The Qt Company. For licensing terms
+** and conditions see https://www.qt.io/terms-conditions. For further
+** information use the contact form at https://www.qt.io/contact-us.
+**
+** BSD License Usage
+** Alternatively, you may use this file under the terms of the BSD license
+** as follows:
+**
+** "Redistribution and use in source and binary forms, with or without
+** modification, are permitted provided that the following conditions are
+** met:
+**   * Redistributions of source code must retain the above copyright
+**     notice, this list of conditions and the following disclaimer.
+**   * Redistributions in binary form must reproduce the above copyright
+**     notice, this list of conditions and the following disclaimer in
+**     the documentation and/or other materials provided with the
+**     distribution.
+**   * Neither the name of The Qt Company Ltd nor the names of its
+**     contributors may be used to endorse or promote products derived
+**     from this software without specific prior written permission.
+**
+**
+** THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+** "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+** LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+** A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+** OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+** SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+** LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+** DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+** THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+** (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+** OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE."
+**
+** $QT_END_LICENSE$
+**
+****************************************************************************/
+
+#include "renderbatch.h"
+
+#include <Qt3DRender/QAttribute>
+#include <Qt3DRender/QBuffer>
+#include <Qt3DRender/QEffect>
+#include <Qt3DRender/QFilterKey>
+#include <Qt3DRender/QGeometry>
+#include <Qt3DRender/QGeometryRenderer>
+#include <Qt3DRender/QGraphicsApiFilter>
+#include <Qt3DRender/QMaterial>
+#include <Qt3DRender/QRenderPass>
+#include <Qt3DRender/QShaderProgram>
+#include <Qt3DRender/QTechnique>
+
+#include <Qt3DCore/QTransform>
+
+#include <Qt3DExtras/QPerVertexColorMaterial>
+#include <Qt3DExtras/QPhongMaterial>
+#include <Qt3DExtras/QSphereGeometry>
+#include <Qt3DExtras/QSphereMesh>
+
+#include <QtGui/QOpenGLContext>
+#include <QtGui/QSurfaceFormat>
+
+//the same source serves desktop OpenGL 3.2 and OpenGL ES 3.0, only the header differs
+static const char sphereVertexShader[] =
+        "in vec3 vertexPosition;\n"
+        "in vec3 vertexNormal;\n"
+        "in vec3 instancePosition;\n"
+        "in vec3 instanceColor;\n"
+        "in float instanceRadius;\n"
+        "out vec3 worldPosition;\n"
+        "out vec3 worldNormal;\n"
+        "out vec3 color;\n"
+        "uniform mat4 modelMatrix;\n"
+        "uniform mat3 modelNormalMatrix;\n"
+        "uniform mat4 modelViewProjection;\n"
+        "void main()\n"
+        "{\n"
+        "    vec4 position = vec4(vertexPosition * instanceRadius + instancePosition, 1.0);\n"
+        "    worldPosition = vec3(modelMatrix * position);\n"
+        "    worldNormal = normalize(modelNormalMatrix * vertexNormal);\n"
+        "    color = instanceColor;\n"
+        "    gl_Position = modelViewProjection * position;\n"
+        "}\n";
+
+//the scene lights as Qt3D hands them to its own materials, shaded with the QPhongMaterial defaults
+static const char sphereFragmentShader[] =
+        "const int MAX_LIGHTS = 8;\n"
+        "const int TYPE_POINT = 0;\n"
+        "const int TYPE_DIRECTIONAL = 1;\n"
+        "const int TYPE_SPOT = 2;\n"
+        "struct Light {\n"
+        "    int type;\n"
+        "    vec3 position;\n"
+        "    vec3 color;\n"
+        "    float intensity;\n"
+        "    vec3 direction;\n"
+        "    float constantAttenuation;\n"
+        "    float linearAttenuation;\n"
+        "    float quadraticAttenuation;\n"
+        "    float cutOffAngle;\n"
+        "};\n"
+        "uniform Light lights[MAX_LIGHTS];\n"
+        "uniform int lightCount;\n"
+        "uniform vec3 eyePosition;\n"
+        "in vec3 worldPosition;\n"
+        "in vec3 worldNormal;\n"
+        "in vec3 color;\n"
+        "out vec4 fragColor;\n"
+        "void main()\n"
+        "{\n"
+        "    vec3 n = normalize(worldNormal);\n"
+        "    vec3 v = normalize(eyePosition - worldPosition);\n"
+        "    vec3 diffuse = vec3(0.0);\n"
+        "    vec3 specular = vec3(0.0);\n"
+        "    for (int i = 0; i < lightCount && i < MAX_LIGHTS; ++i) {\n"
+        "        vec3 s;\n"
+        "        float att = 1.0;\n"
+        "        if (lights[i].type == TYPE_DIRECTIONAL) {\n"
+        "            s = normalize(-lights[i].direction);\n"
+        "        } else {\n"
+        "            s = lights[i].position - worldPosition;\n"
+        "            float d = length(s);\n"
+        "            s = normalize(s);\n"
+        "            att = 1.0 / (lights[i].constantAttenuation + lights[i].linearAttenuation * d +\n"
+        "                         lights[i].quadraticAttenuation * d * d);\n"
+        "            if (lights[i].type == TYPE_SPOT &&\n"
+        "                degrees(acos(dot(-s, normalize(lights[i].direction)))) > lights[i].cutOffAngle)\n"
+        "                att = 0.0;\n"
+        "        }\n"
+        "        float sDotN = max(dot(s, n), 0.0);\n"
+        "        diffuse += att * lights[i].intensity * lights[i].color * sDotN;\n"
+        "        if (sDotN > 0.0)\n"
+        "            specular += att * lights[i].intensity * lights[i].color *\n"
+        "                        pow(max(dot(reflect(-s, n), v), 0.0), 150.0);\n"
+        "    }\n"
+        "    fragColor = vec4(vec3(0.05) + color * diffuse + 0.01 * specular, 1.0);\n"
+        "}\n";
+
+static Qt3DRender::QTechnique *SphereTechnique(Qt3DRender::QGraphicsApiFilter::Api api,
+                                               Qt3DRender::QGraphicsApiFilter::OpenGLProfile profile,
+                                               int major, int minor, const QByteArray &header)
+{
+    Qt3DRender::QShaderProgram *program = new Qt3DRender::QShaderProgram();
+    program->setVertexShaderCode(header + sphereVertexShader);
+    program->setFragmentShaderCode(header + sphereFragmentShader);
+
+    Qt3DRender::QRenderPass *pass = new Qt3DRender::QRenderPass();
+    pass->setShaderProgram(program);
+
+    //QForwardRenderer only picks techniques tagged for forward rendering
+    Qt3DRender::QFilterKey *forward = new Qt3DRender::QFilterKey();
+    forward->setName(QStringLiteral("renderingStyle"));
+    forward->setValue(QStringLiteral("forward"));
+
+    Qt3DRender::QTechnique *technique = new Qt3DRender::QTechnique();
+    technique->graphicsApiFilter()->setApi(api);
+    technique->graphicsApiFilter()->setProfile(profile);
+    technique->graphicsApiFilter()->setMajorVersion(major);
+    technique->graphicsApiFilter()->setMinorVersion(minor);
+    technique->addFilterKey(forward);
+    technique->addRenderPass(pass);
+    return technique;
+}
+
+static Qt3DRender::QAttribute *CopyAttribute(const Qt3DRender::QAttribute *source)
+{
+    Qt3DRender::QAttribute *attribute = new Qt3DRender::QAttribute();
+    attribute->setAttributeType(source->attributeType());
+    attribute->setBuffer(source->buffer());
+    attribute->setDataType(source->vertexBaseType());
+    attribute->setDataSize(source->vertexSize());
+    attribute->setByteOffset(source->byteOffset());
+    attribute->setByteStride(source->byteStride());
+    attribute->setCount(source->count());
+    attribute->setName(source->name());
+    return attribute;
+}
+
+static Qt3DRender::QAttribute *StreamAttribute(Qt3DRender::QBuffer *buffer, const QString &name,
+                                               uint size, uint offset, uint stride, uint divisor)
+{
+    Qt3DRender::QAttribute *attribute = new Qt3DRender::QAttribute();
+    attribute->setAttributeType(Qt3DRender::QAttribute::VertexAttribute);
+    attribute->setBuffer(buffer);
+    attribute->setDataType(Qt3DRender::QAttribute::Float);
+    attribute->setDataSize(size);
+    attribute->setByteOffset(offset);
+    attribute->setByteStride(stride);
+    attribute->setDivisor(divisor);
+    attribute->setCount(0);
+    attribute->setName(name);
+    return attribute;
+}
+
+RenderBatch::Shared::Shared(Qt3DCore::QEntity *owner, bool instanced)
+    : instanced(instanced), sphere(nullptr), sphereMaterial(nullptr)
+{
+    lineMaterial = new Qt3DExtras::QPerVertexColorMaterial(owner);
+    if(!instanced)
+        return;
+
+    sphere = new Qt3DExtras::QSphereGeometry(owner);
+    sphere->setRings(20);
+    sphere->setSlices(20);
+    sphere->setRadius(1.0f);
+
+    //a core context only matches core techniques, a compatibility one only the others
+    Qt3DRender::QEffect *effect = new Qt3DRender::QEffect();
+    effect->addTechnique(SphereTechnique(Qt3DRender::QGraphicsApiFilter::OpenGL,
+                                         Qt3DRender::QGraphicsApiFilter::CoreProfile, 3, 2,
+                                         QByteArrayLiteral("#version 150 core\n")));
+    effect->addTechnique(SphereTechnique(Qt3DRender::QGraphicsApiFilter::OpenGL,
+                                         Qt3DRender::QGraphicsApiFilter::NoProfile, 3, 2,
+                                         QByteArrayLiteral("#version 150\n")));
+    effect->addTechnique(SphereTechnique(Qt3DRender::QGraphicsApiFilter::OpenGLES,
+                                         Qt3DRender::QGraphicsApiFilter::NoProfile, 3, 0,
+                                         QByteArrayLiteral("#version 300 es\nprecision highp float;\n")));
+
+    sphereMaterial = new Qt3DRender::QMaterial(owner);
+    sphereMaterial->setEffect(effect);
+}
+
+bool RenderBatch::InstancingSupported()
+{
+    //Qt3DWindow makes its format the default one before the scene is built
+    const QSurfaceFormat format = QSurfaceFormat::defaultFormat();
+    if(format.renderableType() == QSurfaceFormat::OpenGLES ||
+       QOpenGLContext::openGLModuleType() == QOpenGLContext::LibGLES)
+        return format.majorVersion() >= 3;
+    return format.version() >= qMakePair(3, 2);
+}
+
+RenderBatch::RenderBatch(const Shared &shared, Qt3DCore::QEntity *parent)
+    : Qt3DCore::QEntity(parent), m_instanced(shared.instanced), m_sphereRenderer(nullptr)
+{
+    if(m_instanced)
+    {
+        // Spheres: the shared unit sphere mesh plus one instance per sphere
+        Qt3DRender::QGeometry *sphereGeometry = new Qt3DRender::QGeometry();
+        sphereGeometry->addAttribute(CopyAttribute(shared.sphere->positionAttribute()));
+        sphereGeometry->addAttribute(CopyAttribute(shared.sphere->normalAttribute()));
+        sphereGeometry->addAttribute(CopyAttribute(shared.sphere->indexAttribute()));
+
+        m_spheres.buffer = new Qt3DRender::QBuffer(Qt3DRender::QBuffer::VertexBuffer, sphereGeometry);
+        m_instanceAttributes << StreamAttribute(m_spheres.buffer, QStringLiteral("instancePosition"), 3, 0, SPHERESTRIDE, 1)
+                             << StreamAttribute(m_spheres.buffer, QStringLiteral("instanceColor"), 3, 3 * sizeof(float), SPHERESTRIDE, 1)
+                             << StreamAttribute(m_spheres.buffer, QStringLiteral("instanceRadius"), 1, 6 * sizeof(float), SPHERESTRIDE, 1);
+        for(auto it = m_instanceAttributes.begin(); it != m_instanceAttributes.end(); ++it)
+        {
+            sphereGeometry->addAttribute(*it);
+        }
+
+        m_sphereRenderer = new Qt3DRender::QGeometryRenderer();
+        m_sphereRenderer->setGeometry(sphereGeometry);
+        m_sphereRenderer->setPrimitiveType(Qt3DRender::QGeometryRenderer::Triangles);
+        m_sphereRenderer->setVertexCount(shared.sphere->indexAttribute()->count());
+        m_sphereRenderer->setInstanceCount(0);
+
+        Qt3DCore::QEntity *sphereEntity = new Qt3DCore::QEntity(this);
+        sphereEntity->addComponent(m_sphereRenderer);
+        sphereEntity->addComponent(shared.sphereMaterial);
+    }
+
+    // Lines: every vertex is a position followed by a colour, every pair of vertices is one segment
+    Qt3DRender::QGeometry *lineGeometry = new Qt3DRender::QGeometry();
+    m_lines.buffer = new Qt3DRender::QBuffer(Qt3DRender::QBuffer::VertexBuffer, lineGeometry);
+    m_lineAttributes << StreamAttribute(m_lines.buffer, Qt3DRender::QAttribute::defaultPositionAttributeName(), 3, 0, LINESTRIDE, 0)
+                     << StreamAttribute(m_lines.buffer, Qt3DRender::QAttribute::defaultColorAttributeName(), 3, 3 * sizeof(float), LINESTRIDE, 0);
+    for(auto it = m_lineAttributes.begin(); it != m_lineAttributes.end(); ++it)
+    {
+        lineGeometry->addAttribute(*it);
+    }
+
+    m_lineRenderer = new Qt3DRender::QGeometryRenderer();
+    m_lineRenderer->setGeometry(lineGeometry);
+    m_lineRenderer->setPrimitiveType(Qt3DRender::QGeometryRenderer::Lines);
+    m_lineRenderer->setVertexCount(0);
+
+    Qt3DCore::QEntity *lineEntity = new Qt3DCore::QEntity(this);
+    lineEntity->addComponent(m_lineRenderer);
+    lineEntity->addComponent(shared.lineMaterial);
+}
+
+void RenderBatch::Reserve(int spheres, int lines)
+{
+    if(m_instanced)
+        Grow(m_spheres, spheres * SPHERESTRIDE);
+    else
+        m_sphereEntities.reserve(spheres);
+    Grow(m_lines, 2 * lines * LINESTRIDE);
+}
+
+static QByteArray SphereData(const QVector3D &center, const QColor &colour, float radius)
+{
+    const float data[7] = { center.x(), center.y(), center.z(),
+                            float(colour.redF()), float(colour.greenF()), float(colour.blueF()),
+                            radius };
+    return QByteArray(reinterpret_cast<const char *>(data), sizeof(data));
+}
+
+static QByteArray LineData(const QVector3D &a, const QVector3D &b)
+{
+    const QColor majorColor = QColor(220,220,220);
+    const float data[12] = { a.x(), a.y(), a.z(),
+                             float(majorColor.redF()), float(majorColor.greenF()), float(majorColor.blueF()),
+                             b.x(), b.y(), b.z(),
+                             float(majorColor.redF()), float(majorColor.greenF()), float(majorColor.blueF()) };
+    return QByteArray(reinterpret_cast<const char *>(data), sizeof(data));
+}
+
+void RenderBatch::AddSphere(const QVector3D &center, const QColor &colour, float radius)
+{
+    if(m_instanced)
+    {
+        m_spheres.pending.append(SphereData(center, colour, radius));
+        return;
+    }
+
+    SphereEntity sphere;
+    sphere.mesh = new Qt3DExtras::QSphereMesh();
+    sphere.mesh->setRings(20);
+    sphere.mesh->setSlices(20);
+    sphere.mesh->setRadius(radius);
+
+    sphere.transform = new Qt3DCore::QTransform();
+    sphere.transform->setScale(1.0f);
+    sphere.transform->setTranslation(center);
+
+    sphere.material = new Qt3DExtras::QPhongMaterial();
+    sphere.material->setDiffuse(colour);
+
+    sphere.entity = new Qt3DCore::QEntity(this);
+    sphere.entity->addComponent(sphere.mesh);
+    sphere.entity->addComponent(sphere.material);
+    sphere.entity->addComponent(sphere.transform);
+    sphere.entity->setEnabled(radius > 0);
+    m_sphereEntities.push_back(sphere);
+}
+
+void RenderBatch::AddLine(const QVector3D &a, const QVector3D &b)
+{
+    m_lines.pending.append(LineData(a, b));
+}
+
+void RenderBatch::SetSphere(int index, const QVector3D &center, const QColor &colour, float radius)
+{
+    if(m_instanced)
+    {
+        Write(m_spheres, index * SPHERESTRIDE, SphereData(center, colour, radius));
+        return;
+    }
+
+    SphereEntity &sphere = m_sphereEntities[index];
+    sphere.mesh->setRadius(radius);
+    sphere.transform->setTranslation(center);
+    sphere.material->setDiffuse(colour);
+    sphere.entity->setEnabled(radius > 0);
+}
+
+void RenderBatch::SetLine(int index, const QVector3D &a, const QVector3D &b)
+{
+    Write(m_lines, index * 2 * LINESTRIDE, LineData(a, b));
+}
+
+void RenderBatch::Commit()
+{
+    Upload(m_spheres);
+    Upload(m_lines);
+
+    for(auto it = m_instanceAttributes.begin(); it != m_instanceAttributes.end(); ++it)
+    {
+        (*it)->setCount(SphereCount());
+    }
+    if(m_sphereRenderer)
+        m_sphereRenderer->setInstanceCount(SphereCount());
+
+    for(auto it = m_lineAttributes.begin(); it != m_lineAttributes.end(); ++it)
+    {
+        (*it)->setCount(2 * LineCount());
+    }
+    m_lineRenderer->setVertexCount(2 * LineCount());
+}
+
+int RenderBatch::SphereCount() const
+{
+    return m_instanced ? m_spheres.used / SPHERESTRIDE : m_sphereEntities.size();
+}
+
+int RenderBatch::LineCount() const
+{
+    return m_lines.used / (2 * LINESTRIDE);
+}
+
+qint64 RenderBatch::Footprint() const
+{
+    return qint64(NODECOUNT) * NODEBYTES + qint64(SPHERENODES) * NODEBYTES * m_sphereEntities.size() +
+           2 * (qint64(m_spheres.capacity) + m_lines.capacity);
+}
+
+qint64 RenderBatch::RecordBytes(int spheres, int lines) const
+{
+    const qint64 sphereBytes = m_instanced ? 2 * SPHERESTRIDE : qint64(SPHERENODES) * NODEBYTES;
+    return spheres * sphereBytes + 2 * 2 * qint64(lines) * LINESTRIDE;
+}
+
+void RenderBatch::Write(Stream &stream, int offset, const QByteArray &bytes)
+{
+    //still pending records are patched in place, uploaded ones are updated on the GPU
+    if(offset >= stream.used)
+        stream.pending.replace(offset - stream.used, bytes.size(), bytes);
+    else
+        stream.buffer->updateData(offset, bytes);
+}
+
+void RenderBatch::Upload(Stream &stream)
+{
+    if(stream.pending.isEmpty())
+        return;
+
+    const int needed = stream.used + stream.pending.size();
+    if(needed > stream.capacity)
+        Grow(stream, qMax(needed, 2 * stream.capacity));
+
+    //only the appended bytes are sent, the rest of the buffer stays where it is
+    stream.buffer->updateData(stream.used, stream.pending);
+    stream.used = needed;
+    stream.pending.clear();
+}
+
+void RenderBatch::Grow(Stream &stream, int capacity)
+{
+    if(capacity <= stream.capacity)
+        return;
+
+    QByteArray data = stream.buffer->data();
+    data.append(QByteArray(capacity - data.size(), '\0'));
+    stream.buffer->setData(data);
+    stream.capacity = capacity;
+}
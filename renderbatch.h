@@ -0,0 +1,153 @@
+/****************************************************************************
+**
+** Copyright (C) 2014 Klaralvdalens Datakonsult AB (KDAB).
+** Contact: https://www.qt.io/licensing/
+**
+** This file is part of the Qt3D module of the Qt Toolkit.
+**
+** $QT_BEGIN_LICENSE:BSD$
+** Commercial License Usage
+** Licensees holding valid commercial Qt licenses may use this file in
+** accordance with the commercial license agreement provided with the
+** Software or, alternatively, in accordance with the terms contained in
+** a written agreement between you and The Qt Company. For licensing terms
+** and conditions see https://www.qt.io/terms-conditions. For further
+** information use the contact form at https://www.qt.io/contact-us.
+**
+** BSD License Usage
+** Alternatively, you may use this file under the terms of the BSD license
+** as follows:
+**
+** "Redistribution and use in source and binary forms, with or without
+** modification, are permitted provided that the following conditions are
+** met:
+**   * Redistributions of source code must retain the above copyright
+**     notice, this list of conditions and the following disclaimer.
+**   * Redistributions in binary form must reproduce the above copyright
+**     notice, this list of conditions and the following disclaimer in
+**     the documentation and/or other materials provided with the
+**     distribution.
+**   * Neither the name of The Qt Company Ltd nor the names of its
+**     contributors may be used to endorse or promote products derived
+**     from this software without specific prior written permission.
+**
+**
+** THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+** "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+** LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+** A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+** OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+** SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+** LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+** DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+** THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+** (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+** OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE."
+**
+** $QT_END_LICENSE$
+**
+****************************************************************************/
+
+#ifndef RENDERBATCH_H
+#define RENDERBATCH_H
+
+#include <QtCore/QByteArray>
+#include <QtCore/QVector>
+#include <QtGui/QColor>
+#include <QtGui/QVector3D>
+
+#include <Qt3DCore/qentity.h>
+
+namespace Qt3DRender {
+class QAttribute;
+class QBuffer;
+class QGeometryRenderer;
+class QMaterial;
+}
+
+namespace Qt3DCore {
+class QTransform;
+}
+
+namespace Qt3DExtras {
+class QPhongMaterial;
+class QSphereGeometry;
+class QSphereMesh;
+}
+
+//spheres drawn as instances of one shared mesh plus every edge in a single line buffer,
+//whatever is added between two Commit calls is appended to the existing buffers;
+//without instancing every sphere is its own QPhongMaterial entity, as the scene always did
+class RenderBatch : public Qt3DCore::QEntity
+{
+public:
+    //mesh and materials shared by all batches of a scene
+    struct Shared
+    {
+        Shared(Qt3DCore::QEntity *owner, bool instanced);
+
+        bool instanced;
+        Qt3DExtras::QSphereGeometry *sphere;
+        Qt3DRender::QMaterial *sphereMaterial;
+        Qt3DRender::QMaterial *lineMaterial;
+    };
+
+    //instanced drawing needs OpenGL 3.2 or OpenGL ES 3.0
+    static bool InstancingSupported();
+
+    RenderBatch(const Shared &shared, Qt3DCore::QEntity *parent);
+
+    void Reserve(int spheres, int lines);
+    void AddSphere(const QVector3D &center, const QColor &colour, float radius);
+    void AddLine(const QVector3D &a, const QVector3D &b);
+    //overwrite a sphere or line added earlier, a zero radius or length hides it
+    void SetSphere(int index, const QVector3D &center, const QColor &colour, float radius);
+    void SetLine(int index, const QVector3D &a, const QVector3D &b);
+    void Commit();
+
+    int SphereCount() const;
+    int LineCount() const;
+    //bytes the given number of records add to Footprint
+    qint64 RecordBytes(int spheres, int lines) const;
+    //rough bytes held by the batch: its Qt3D nodes plus frontend and GPU copies of the buffers
+    qint64 Footprint() const;
+
+private:
+    struct Stream
+    {
+        Qt3DRender::QBuffer *buffer = nullptr;
+        QByteArray pending;
+        int used = 0;
+        int capacity = 0;
+    };
+
+    struct SphereEntity
+    {
+        Qt3DCore::QEntity *entity;
+        Qt3DExtras::QSphereMesh *mesh;
+        Qt3DCore::QTransform *transform;
+        Qt3DExtras::QPhongMaterial *material;
+    };
+
+    void Write(Stream &stream, int offset, const QByteArray &bytes);
+    void Upload(Stream &stream);
+    void Grow(Stream &stream, int capacity);
+
+    const bool m_instanced;
+    QVector<SphereEntity> m_sphereEntities;
+    Stream m_spheres;
+    Stream m_lines;
+    Qt3DRender::QGeometryRenderer *m_sphereRenderer;
+    Qt3DRender::QGeometryRenderer *m_lineRenderer;
+    QVector<Qt3DRender::QAttribute *> m_instanceAttributes;
+    QVector<Qt3DRender::QAttribute *> m_lineAttributes;
+
+    static constexpr int SPHERESTRIDE = 7 * sizeof(float);
+    static constexpr int LINESTRIDE = 6 * sizeof(float);
+    static constexpr int NODECOUNT = 17;
+    static constexpr int NODEBYTES = 1024;
+    //entity, mesh, geometry, its buffers and attributes, transform and material
+    static constexpr int SPHERENODES = 12;
+};
+
+#endif // RENDERBATCH_H
@@ -49,147 +49,556 @@
 ****************************************************************************/
 
 #include "scenemodifier.h"
+#ifdef HAVE_LIVEFEED
+#include "feedring.h"
+#endif
 
 #include <QtCore/QDebug>
+#include <QtCore/QCoreApplication>
+#include <QtCore/QProcess>
+#include <QtCore/QThread>
+#include <Qt3DLogic/QFrameAction>
 #include <Qt3DRender>
 #include <Qt3DRender/QMesh>
 
 #include<Qt3DExtras/QPerVertexColorMaterial>
 #include <Qt3DRender/QAttribute>
+#include <QtConcurrent/QtConcurrentMap>
 
+#include <algorithm>
+#include <cfloat>
 #include <cmath>
 #include <ctime>
+#include <random>
 
 
 
-SceneModifier::SceneModifier(Qt3DCore::QEntity *rootEntity)
-    : m_rootEntity(rootEntity)
+SceneModifier::SceneModifier(Qt3DCore::QEntity *rootEntity, Mode mode, int trees, bool relaxed)
+    : m_rootEntity(rootEntity), m_shared(rootEntity, mode != SingleTree && RenderBatch::InstancingSupported()),
+      m_mode(mode)
 {  
+    spheres.relax = relaxed;
+
+    if(mode == Forest)
+    {
+        GenerateForest(trees,relaxed);
+        return;
+    }
+
+#ifdef HAVE_LIVEFEED
+    if(mode == LiveFeed)
+    {
+        StartFeed(trees,relaxed);
+        return;
+    }
+#endif
+
+    if(mode == LazyTree)
+    {
+        spheres.SetParent( new Node( QVector3D(0,8,0), RADROOT,spheres.colors[0]) );
+        spheres.parent->seed = std::random_device{}();
+        m_lazyBatch = new RenderBatch(m_shared,m_rootEntity);
+        m_lazyBatch->AddSphere(spheres.parent->center,spheres.parent->colour,spheres.parent->radius);
+        m_lazyBatch->Commit();
+        return;
+    }
+
+    if(mode == CompactTree)
+    {
+        spheres.SetParent( new Node( QVector3D(0,8,0), RADROOT,spheres.colors[0]) );
+        m_packed.Begin(spheres.parent);
+
+        //only the layer being generated and its parents exist as Node objects, everything older
+        //lives in m_packed and, as plain spheres, in the tree's collision index
+        QVector<Node *> parents;
+        parents.push_back(spheres.parent);
+        for(int layer = 1; layer < L && !parents.isEmpty(); ++layer)
+        {
+            spheres.GenerateLayer(layer,parents);
+            m_packed.AppendLayer(parents);
+
+            QVector<Node *> children;
+            for(int i = 0; i < parents.size(); ++i)
+            {
+                children += parents[i]->children;
+            }
+            spheres.ReleaseLayer(parents);
+            parents = children;
+        }
+        spheres.ReleaseLayer(parents);
+        m_packed.End();
+
+        //the index only serves the rejection checks, keeping it would cost more than m_packed
+        spheres.index = QHash<quint64, QVector<Tree::Sphere>>();
+
+        RenderBatch *batch = new RenderBatch(m_shared,m_rootEntity);
+        m_packed.Decode(batch,spheres);
+        return;
+    }
+
     //create and draw parent node
     spheres.SetParent( new Node( QVector3D(0,8,0), RADROOT,spheres.colors[0]) );
     auto parent = spheres.parent;
-    DrawSphere(parent->center,parent->colour,parent->radius);
-
+    RenderBatch *batch = new RenderBatch(m_shared,m_rootEntity);
+    batch->AddSphere(parent->center,parent->colour,parent->radius);
 
-    spheres.GenerateRandNodes(1,parent);
 
-    spheres.GenerateNodes(2,parent->children);
+    spheres.Generate();
 
-    spheres.Draw(this,parent->children,parent);
+    spheres.Draw(batch,parent);
+    batch->Commit();
 
 }
 
 SceneModifier::~SceneModifier()
 {
+    for (auto it = m_shards.begin() ; it != m_shards.end(); ++it)
+    {
+        delete (*it);
+    }
+    m_shards.clear();
+
+#ifdef HAVE_LIVEFEED
+    //closing first releases workers blocked on a full ring
+    for (auto it = m_feeds.begin() ; it != m_feeds.end(); ++it)
+    {
+        (*it)->Close();
+    }
+    for (auto it = m_workers.begin() ; it != m_workers.end(); ++it)
+    {
+        if(!(*it)->waitForFinished(1000))
+            (*it)->kill();
+    }
+    for (auto it = m_feeds.begin() ; it != m_feeds.end(); ++it)
+    {
+        delete (*it);
+    }
+    m_feeds.clear();
+#endif
+}
+
+#ifdef HAVE_LIVEFEED
+void SceneModifier::StartFeed(int trees, bool relaxed)
+{
+    const int workers = qBound(1, QThread::idealThreadCount(), trees);
+
+    for(int i = 0; i < workers; ++i)
+    {
+        QString name = QStringLiteral("/basicshapes-%1-%2").arg(QCoreApplication::applicationPid()).arg(i);
+        FeedRing *feed = FeedRing::Create(name, FEEDCAPACITY);
+        if(!feed)
+            continue;
+        m_feeds.push_back(feed);
+
+        //one persistent batch per ring, growing with what has been ingested so far
+        m_feedBatches.push_back(new RenderBatch(m_shared,m_rootEntity));
+
+        //a crashed or stalled generator only stops its own ring, the viewer keeps running
+        QProcess *worker = new QProcess(this);
+        worker->setProcessChannelMode(QProcess::ForwardedChannels);
+        connect(worker, QOverload<int, QProcess::ExitStatus>::of(&QProcess::finished),
+                [name](int code, QProcess::ExitStatus status)
+        {
+            if(status == QProcess::CrashExit || code != 0)
+                qWarning() << "feed worker" << name << "stopped with code" << code;
+        });
+
+        QString spec = QStringLiteral("%1:%2:%3:%4:%5").arg(name).arg(i).arg(workers).arg(trees).arg(int(relaxed));
+        worker->start(QCoreApplication::applicationFilePath(), QStringList() << QStringLiteral("--feed-worker") << spec);
+        m_workers.push_back(worker);
+    }
 
+    Qt3DLogic::QFrameAction *frameAction = new Qt3DLogic::QFrameAction;
+    m_rootEntity->addComponent(frameAction);
+    connect(frameAction, &Qt3DLogic::QFrameAction::triggered, this, &SceneModifier::IngestFeeds);
+    m_statsTimer.start();
 }
 
-void SceneModifier::DrawLine(const QVector3D& a,const QVector3D& b)
+void SceneModifier::IngestFeeds(float dt)
 {
-    Qt3DRender::QGeometryRenderer * meshRenderer = new Qt3DRender::QGeometryRenderer;
-    Qt3DRender::QGeometry * geometry = new Qt3DRender::QGeometry(meshRenderer);
+    Q_UNUSED(dt);
+    ++m_frame;
+
+    const int feeds = m_feeds.size();
+    QVector<bool> dirty(feeds,false);
+
+    for(auto it = m_feeds.begin(); it != m_feeds.end(); ++it)
+    {
+        (*it)->SetFrame(m_frame);
+    }
+
+    //records are read straight out of the shared mapping, a wrapped ring takes two spans
+    auto drain = [&](int f, quint32 quota)
+    {
+        quint32 drained = 0;
+        for(int span = 0; span < 2 && quota > 0; ++span)
+        {
+            quint32 count = 0;
+            const FeedRecord *records = m_feeds[f]->Peek(count,quota);
+            if(count == 0)
+                break;
+
+            for(quint32 i = 0; i < count; ++i)
+            {
+                const FeedRecord &record = records[i];
+                QVector3D center(record.center[0],record.center[1],record.center[2]);
+                m_feedBatches[f]->AddSphere(center,spheres.LayerColor(record.layer),record.radius);
+                if(record.hasParent)
+                    m_feedBatches[f]->AddLine(QVector3D(record.parent[0],record.parent[1],record.parent[2]),center);
+                m_latency += m_frame - record.frame;
+            }
 
-    Qt3DRender::QBuffer * vertexDataBuffer = new Qt3DRender::QBuffer(Qt3DRender::QBuffer::VertexBuffer, geometry);
+            m_feeds[f]->Release(count);
+            dirty[f] = true;
+            quota -= count;
+            drained += count;
+            m_ingested += count;
+        }
+        return drained;
+    };
+
+    // Ingest is bounded by time, not by a record count, so throughput follows how fast this
+    // machine appends: the rings take turns of FEEDCHUNK records until FEEDSLICE has passed or
+    // all of them are empty. The ring served first rotates so no feed is always the one cut short.
+    QElapsedTimer slice;
+    slice.start();
+    bool more = true;
+    while(more && slice.nsecsElapsed() < FEEDSLICE)
+    {
+        more = false;
+        for(int n = 0; n < feeds && slice.nsecsElapsed() < FEEDSLICE; ++n)
+        {
+            const int f = (m_nextFeed + n) % feeds;
+            if(m_feeds[f]->Finished())
+                continue;
 
-    int vertexNum = 6*2;
+            if(drain(f,FEEDCHUNK) == FEEDCHUNK)
+                more = true;
+        }
+    }
+    if(feeds > 0)
+        m_nextFeed = (m_nextFeed + 1) % feeds;
 
-    float* vertexRawData = new float[vertexNum];
-    int idx = 0;
-    QColor majorColor = QColor(220,220,220);
+    for(int f = 0; f < feeds; ++f)
+    {
+        if(dirty[f])
+            m_feedBatches[f]->Commit();
+    }
 
-    vertexRawData[idx++] = a.x();
-    vertexRawData[idx++] = a.y();
-    vertexRawData[idx++] = a.z();
+    if(m_statsTimer.elapsed() >= 1000)
+    {
+        quint64 stalls = 0;
+        for(auto it = m_feeds.begin(); it != m_feeds.end(); ++it)
+        {
+            stalls += (*it)->Stalls();
+        }
+
+        double nodesPerSecond = m_ingested * 1000.0 / m_statsTimer.restart();
+        double latencyFrames = m_ingested ? double(m_latency) / m_ingested : 0;
+        emit FeedStats(nodesPerSecond,latencyFrames,stalls);
+
+        m_ingested = 0;
+        m_latency = 0;
+    }
+}
 
-    vertexRawData[idx++] = majorColor.redF();
-    vertexRawData[idx++] = majorColor.greenF();
-    vertexRawData[idx++] = majorColor.blueF();
+int SceneModifier::RunFeedWorker(const QString &spec)
+{
+    //name:index:workers:trees:relaxed as written by StartFeed
+    QStringList parts = spec.split(QLatin1Char(':'));
+    if(parts.size() != 5)
+    {
+        qWarning() << "malformed feed worker spec" << spec;
+        return 1;
+    }
 
-    vertexRawData[idx++] = b.x();
-    vertexRawData[idx++] = b.y();
-    vertexRawData[idx++] = b.z();
-    vertexRawData[idx++] = majorColor.redF();
-    vertexRawData[idx++] = majorColor.greenF();
-    vertexRawData[idx++] = majorColor.blueF();
+    FeedRing *feed = FeedRing::Open(parts[0]);
+    if(!feed)
+        return 1;
 
+    const int index = parts[1].toInt();
+    const int workers = parts[2].toInt();
+    const int trees = parts[3].toInt();
+    const int side = std::ceil(std::sqrt(trees));
 
-    QByteArray ba;
-    int bufferSize = vertexNum * sizeof(float);
-    ba.resize(bufferSize);
-    memcpy(ba.data(), reinterpret_cast<const char*>(vertexRawData), bufferSize);
-    vertexDataBuffer->setData(ba);
+    //trees are laid out like the forest, each worker takes every workers-th cell
+    for(int i = index; i < trees; i += workers)
+    {
+        Tree tree;
+        tree.relax = parts[4].toInt() != 0;
+        QVector3D center((i % side)*SHARDSIZE, 8, (i / side)*SHARDSIZE);
+        tree.SetParent( new Node(center, RADROOT, tree.colors[0]) );
+        tree.Generate();
+
+        if(!feed->ViewerAlive() || !PublishTree(feed,tree.parent,nullptr))
+            break;
+    }
 
-    int stride = 6 * sizeof(float);
+    //a viewer that died never gets to Close and unlink the ring, so the last user cleans up
+    if(!feed->ViewerAlive())
+        feed->Unlink();
+    feed->Finish();
+    delete feed;
+    return 0;
+}
 
-    // Attributes
-    Qt3DRender::QAttribute *positionAttribute = new Qt3DRender::QAttribute();
-    positionAttribute->setAttributeType(Qt3DRender::QAttribute::VertexAttribute);
-    positionAttribute->setBuffer(vertexDataBuffer);
-    positionAttribute->setDataType(Qt3DRender::QAttribute::Float);
-    positionAttribute->setDataSize(3);
-    positionAttribute->setByteOffset(0);
-    positionAttribute->setByteStride(stride);
-    positionAttribute->setCount(vertexNum / 2);
-    positionAttribute->setName(Qt3DRender::QAttribute::defaultPositionAttributeName());
+bool SceneModifier::PublishTree(FeedRing *feed, const Node * const node, const Node * const parent)
+{
+    FeedRecord record;
+    for(int axis = 0; axis < 3; ++axis)
+    {
+        record.center[axis] = node->center[axis];
+        record.parent[axis] = parent ? parent->center[axis] : 0;
+    }
+    record.radius = node->radius;
+    record.layer = node->layer;
+    record.hasParent = parent != nullptr;
+    record.frame = 0;
 
+    if(!feed->Publish(record))
+        return false;
 
-    Qt3DRender::QAttribute *colorAttribute = new Qt3DRender::QAttribute();
-    colorAttribute->setAttributeType(Qt3DRender::QAttribute::VertexAttribute);
-    colorAttribute->setBuffer(vertexDataBuffer);
-    colorAttribute->setDataType(Qt3DRender::QAttribute::Float);
-    colorAttribute->setDataSize(3);
-    colorAttribute->setByteOffset(3 * sizeof(float));
-    colorAttribute->setByteStride(stride);
-    colorAttribute->setCount(vertexNum / 2);
-    colorAttribute->setName(Qt3DRender::QAttribute::defaultColorAttributeName());
+    for(size_t i = 0; i < node->children.size(); ++i)
+    {
+        if(!PublishTree(feed,node->children[i],node))
+            return false;
+    }
+    return true;
+}
+#endif
 
-    geometry->addAttribute(positionAttribute);
-    geometry->addAttribute(colorAttribute);
+void SceneModifier::GenerateForest(int trees, bool relaxed)
+{
+    const int side = std::ceil(std::sqrt(trees));
 
-    meshRenderer->setInstanceCount(1);
-    meshRenderer->setIndexOffset(0);
-    meshRenderer->setFirstInstance(0);
-    meshRenderer->setPrimitiveType(Qt3DRender::QGeometryRenderer::Lines);
-    meshRenderer->setGeometry(geometry);
-    meshRenderer->setVertexCount(vertexNum / 2);
+    std::mt19937 gen;
+    gen.seed(std::random_device{}());
+    std::uniform_real_distribution<float> jitter(-SHARDSIZE/4, SHARDSIZE/4);
 
-    Qt3DExtras::QPerVertexColorMaterial * material = new Qt3DExtras::QPerVertexColorMaterial(m_rootEntity);
-    Qt3DCore::QTransform *transform = new Qt3DCore::QTransform;
-    transform->setScale(1.0f);
+    //roots are placed up front so that every shard sees its neighbours while generating
+    for(int i = 0; i < trees; ++i)
+    {
+        Shard *shard = new Shard;
+        shard->row = i / side;
+        shard->col = i % side;
+
+        QVector3D center(shard->col*SHARDSIZE + jitter(gen), 8, shard->row*SHARDSIZE + jitter(gen));
+        shard->tree.SetParent( new Node(center, RADROOT, shard->tree.colors[0]) );
+        shard->tree.relax = relaxed;
+        shard->batch = new RenderBatch(m_shared,m_rootEntity);
+        m_shards.push_back(shard);
+    }
 
-    Qt3DCore::QEntity *entity = new Qt3DCore::QEntity(m_rootEntity);
-    entity->addComponent(meshRenderer);
-    entity->addComponent(transform);
-    entity->addComponent(material);
+    for(int i = 0; i < m_shards.size(); ++i)
+    {
+        Shard *shard = m_shards[i];
+        for(int row = shard->row - 1; row <= shard->row + 1; ++row)
+        {
+            for(int col = shard->col - 1; col <= shard->col + 1; ++col)
+            {
+                int idx = row * side + col;
+                if(row < 0 || col < 0 || col >= side || idx >= trees || idx == i)
+                    continue;
+                shard->tree.neighbours.push_back(&m_shards[idx]->tree);
+            }
+        }
+    }
 
-    entity->setParent(m_rootEntity);
+    // A tree never reaches past its adjacent cells, so shards with the same row/column
+    // parity cannot touch each other and every pass can be generated in parallel,
+    // relaxation included.
+    for(int pass = 0; pass < 4; ++pass)
+    {
+        QVector<Shard *> batch;
+        for(auto it = m_shards.begin(); it != m_shards.end(); ++it)
+        {
+            if(((*it)->row % 2) * 2 + (*it)->col % 2 == pass)
+                batch.push_back(*it);
+        }
 
-    delete [] vertexRawData;
+        QtConcurrent::blockingMap(batch, [](Shard *shard)
+        {
+            shard->tree.Generate();
+        });
+    }
 
+    //Qt3D entities must be created on the gui thread
+    for(auto it = m_shards.begin(); it != m_shards.end(); ++it)
+    {
+        auto parent = (*it)->tree.parent;
+        (*it)->batch->AddSphere(parent->center,parent->colour,parent->radius);
+        (*it)->tree.Draw((*it)->batch,parent);
+        (*it)->batch->Commit();
+    }
 }
 
-void SceneModifier::DrawSphere(const QVector3D& a,QColor color,float radius)
+int SceneModifier::ShardCount() const
 {
-    // Sphere shape data
-    Qt3DExtras::QSphereMesh *sphereMesh = new Qt3DExtras::QSphereMesh();
-    sphereMesh->setRings(20);
-    sphereMesh->setSlices(20);
-    sphereMesh->setRadius(radius);
+    return m_shards.size();
+}
 
-    // Sphere mesh transform
-    Qt3DCore::QTransform *sphereTransform = new Qt3DCore::QTransform();
+bool SceneModifier::IsShardVisible(int shard) const
+{
+    if(shard < 0 || shard >= m_shards.size())
+        return false;
 
-    sphereTransform->setScale(1.0f);
-    sphereTransform->setTranslation(a);
+    return m_shards[shard]->batch->isEnabled();
+}
 
-    Qt3DExtras::QPhongMaterial *sphereMaterial = new Qt3DExtras::QPhongMaterial();
-    sphereMaterial->setDiffuse(color);
+int SceneModifier::PackedNodeCount() const
+{
+    return m_packed.nodes.size();
+}
 
-    // Sphere
-    Qt3DCore::QEntity *sphereEntity = new Qt3DCore::QEntity(m_rootEntity);
-    sphereEntity->addComponent(sphereMesh);
-    sphereEntity->addComponent(sphereMaterial);
-    sphereEntity->addComponent(sphereTransform);
+double SceneModifier::PackedBytesPerNode() const
+{
+    return m_packed.BytesPerNode();
+}
+
+double SceneModifier::PointerBytesPerNode() const
+{
+    //node, its slot in the parent's vector and the children vector's heap header
+    return sizeof(Node) + sizeof(Node *) + sizeof(QArrayData);
+}
+
+float SceneModifier::PackedMaxError() const
+{
+    return m_packed.maxError;
+}
+
+int SceneModifier::RelaxDropped() const
+{
+    int dropped = spheres.dropped;
+    for(auto it = m_shards.begin(); it != m_shards.end(); ++it)
+    {
+        dropped += (*it)->tree.dropped;
+    }
+    return dropped;
+}
+
+void SceneModifier::SetShardVisible(int shard, bool visible)
+{
+    if(shard < 0 || shard >= m_shards.size())
+        return;
+
+    m_shards[shard]->batch->setEnabled(visible);
+}
+
+void SceneModifier::SetAllShardsVisible(bool visible)
+{
+    for(auto it = m_shards.begin(); it != m_shards.end(); ++it)
+    {
+        (*it)->batch->setEnabled(visible);
+    }
+}
+
+void SceneModifier::UpdateCamera(const QVector3D &position)
+{
+    if(m_mode != LazyTree)
+        return;
+
+    ++m_update;
+    QVector<const Node *> ancestors;
+    ExpandNear(spheres.parent,position,ancestors);
+
+    //expansions on a path to the camera were touched in this update and are never evicted
+    while(m_lazyBytes > LAZYBUDGET && !m_lru.empty())
+    {
+        Node *victim = m_lru.back();
+        if(m_expanded.value(victim).touched == m_update)
+            break;
+        Collapse(victim);
+    }
+
+    m_lazyBatch->Commit();
+}
+
+bool SceneModifier::ExpandNear(Node *node, const QVector3D &position, QVector<const Node *> &ancestors)
+{
+    bool near = node->center.distanceToPoint(position) <= EXPANDDIST;
+
+    if(near && !m_expanded.contains(node))
+    {
+        spheres.Expand(node,ancestors);
+
+        const int slot = AcquireSlot();
+        for(int i = 0; i < node->children.size(); ++i)
+        {
+            const Node * const child = node->children[i];
+            m_lazyBatch->SetSphere(1 + slot*NMAX + i,child->center,child->colour,child->radius);
+            m_lazyBatch->SetLine(slot*NMAX + i,node->center,child->center);
+        }
+
+        //the children, their slots and vector header, plus the slot's share of the batch
+        qint64 bytes = node->children.size() * qint64(sizeof(Node) + sizeof(Node *)) + sizeof(QArrayData)
+                       + m_lazyBatch->RecordBytes(NMAX,NMAX);
+        m_lazyBytes += bytes;
+
+        m_lru.push_front(node);
+        m_expanded.insert(node,Expansion{slot,m_lru.begin(),bytes,m_update});
+    }
+
+    if(!m_expanded.contains(node))
+        return near;
+
+    ancestors.push_back(node);
+    for(size_t i = 0; i < node->children.size(); ++i)
+    {
+        near |= ExpandNear(node->children[i],position,ancestors);
+    }
+    ancestors.pop_back();
+
+    //touching after the children keeps every ancestor ahead of its descendants in m_lru
+    if(near)
+    {
+        Expansion &expansion = m_expanded[node];
+        m_lru.splice(m_lru.begin(),m_lru,expansion.lru);
+        expansion.touched = m_update;
+    }
+    return near;
+}
+
+void SceneModifier::Collapse(Node *node)
+{
+    if(!m_expanded.contains(node))
+        return;
+
+    Expansion expansion = m_expanded.take(node);
+
+    for(size_t i = 0; i < node->children.size(); ++i)
+    {
+        Collapse(node->children[i]);
+        delete node->children[i];
+    }
+    node->children.clear();
+
+    for(int i = 0; i < NMAX; ++i)
+    {
+        m_lazyBatch->SetSphere(1 + expansion.slot*NMAX + i,QVector3D(),QColor(),0);
+        m_lazyBatch->SetLine(expansion.slot*NMAX + i,QVector3D(),QVector3D());
+    }
+    m_freeSlots.push_back(expansion.slot);
+
+    m_lazyBytes -= expansion.bytes;
+    m_lru.erase(expansion.lru);
+}
+
+int SceneModifier::AcquireSlot()
+{
+    if(!m_freeSlots.isEmpty())
+    {
+        const int slot = m_freeSlots.back();
+        m_freeSlots.pop_back();
+        return slot;
+    }
+
+    //new slots start hidden, the expansion fills in as many as it has children
+    for(int i = 0; i < NMAX; ++i)
+    {
+        m_lazyBatch->AddSphere(QVector3D(),QColor(),0);
+        m_lazyBatch->AddLine(QVector3D(),QVector3D());
+    }
+    return m_slots++;
 }
 
 void SceneModifier::Tree::CreateColors()
@@ -206,6 +615,7 @@ void SceneModifier::Tree::CreateColors()
 SceneModifier::Tree::Tree()
 {
     CreateColors();
+    gen.seed(std::random_device{}());
 }
 
 SceneModifier::Tree::~Tree()
@@ -216,30 +626,72 @@ SceneModifier::Tree::~Tree()
 void SceneModifier::Tree::SetParent(SceneModifier::Node *root)
 {
     parent = root;
+    scope = root;
+    index.clear();
+
+    if(!root)
+        return;
+
+    boundsMin = boundsMax = root->center;
+    Index(root);
 }
 
-void SceneModifier::Tree::Draw(SceneModifier * const sc, QVector<Node*>children, Node* parent)
+void SceneModifier::Tree::Draw(RenderBatch *batch, const Node * const node)
 {
-    if(children.size() == 0)
-        return;
+    for(size_t i = 0; i < node->children.size(); ++i)
+    {
+        batch->AddSphere(node->children[i]->center,node->children[i]->colour,node->children[i]->radius);
+        batch->AddLine(node->center,node->children[i]->center);
+    }
 
-    for(size_t i = 0; i < children.size(); ++i)
+    for(size_t i = 0; i< node->children.size(); ++i)
     {
-        sc->DrawSphere(children[i]->center,children[i]->colour,children[i]->radius);
-        sc->DrawLine(parent->center,children[i]->center);
+        Draw(batch,node->children[i]);
     }
 
-    for(size_t i = 0; i< children.size(); ++i)
+}
+
+void SceneModifier::Tree::Attach(Node * const par, Node * const child)
+{
+    par->AddChild(child);
+
+    //lazily expanded subtrees come and go, only the eagerly generated tree is indexed
+    if(scope == parent)
+        Index(child);
+}
+
+void SceneModifier::Tree::Index(const Node * const node)
+{
+    index[CellKey(node->center,0,0,0)].push_back(Sphere{node->center,node->radius});
+
+    for(int axis = 0; axis < 3; ++axis)
     {
-        Draw(sc,children[i]->children,children[i]);
+        boundsMin[axis] = std::min(boundsMin[axis], node->center[axis] - node->radius);
+        boundsMax[axis] = std::max(boundsMax[axis], node->center[axis] + node->radius);
     }
+}
 
+bool SceneModifier::Tree::IndexCollides(const Node * const node) const
+{
+    for(int dx = -1; dx <= 1; ++dx)
+    for(int dy = -1; dy <= 1; ++dy)
+    for(int dz = -1; dz <= 1; ++dz)
+    {
+        auto cell = index.constFind(CellKey(node->center,dx,dy,dz));
+        if(cell == index.constEnd())
+            continue;
+
+        for(const Sphere& sphere : *cell)
+        {
+            if(node->center.distanceToPoint(sphere.center) <= node->radius + sphere.radius)
+                return true;
+        }
+    }
+    return false;
 }
 
 void SceneModifier::Tree::GenerateRandNodes(int layer,Node * par)
 {
-    std::mt19937 gen;
-    gen.seed(std::random_device{}());
     std::uniform_int_distribution<> dis(1, NMAX);
     int nodes = dis(gen);
     if( nodes > PLANESIZE)
@@ -258,19 +710,83 @@ void SceneModifier::Tree::GenerateRandNodes(int layer,Node * par)
         while( candidates.size() < nodes)
         {
             QVector3D temp(xDistr(gen),yDistr(gen),zDistr(gen));
-            auto candidate = new Node(temp,RADNODE,colors[layer]);
-            if( ! CollideOrExist(candidate,parent) )
+            auto candidate = new Node(temp,RADNODE,LayerColor(layer));
+            if( ! Collides(candidate) )
             {
                 candidates.push_back(candidate);
             }
+            else
+            {
+                delete candidate;
+            }
 
         }
 
         for(size_t i = 0; i< candidates.size(); ++i)
         {
-             par->AddChild(candidates[i]);
+             Attach(par,candidates[i]);
         }
     }
+
+    AssignSeeds(par,layer);
+}
+
+void SceneModifier::Tree::AssignSeeds(Node * const par, const int &layer)
+{
+    for(size_t i = 0; i < par->children.size(); ++i)
+    {
+        par->children[i]->seed = ChildSeed(par->seed,i);
+        par->children[i]->layer = layer;
+    }
+}
+
+void SceneModifier::Tree::Expand(Node * const node, const QVector<const Node *> &ancestors)
+{
+    //seeding from the node and checking only its own subtree and the settled spheres keeps the
+    //result independent of whatever else is loaded at the moment
+    gen.seed(node->seed);
+    scope = node;
+    settled.clear();
+    settled.push_back(parent);
+    for(int i = 0; i < ancestors.size(); ++i)
+    {
+        for(size_t j = 0; j < ancestors[i]->children.size(); ++j)
+        {
+            if(ancestors[i]->children[j] != node)
+                settled.push_back(ancestors[i]->children[j]);
+        }
+    }
+
+    if(relax)
+        RelaxLayer(node->layer + 1,QVector<Node *>() << node);
+    else
+        GenerateRandNodes(node->layer + 1,node);
+    scope = parent;
+    settled.clear();
+}
+
+bool SceneModifier::Tree::SettledCollides(const Node * const node) const
+{
+    for(int i = 0; i < settled.size(); ++i)
+    {
+        if(node->center.distanceToPoint(settled[i]->center) <= node->radius + settled[i]->radius)
+            return true;
+    }
+    return false;
+}
+
+QColor SceneModifier::Tree::LayerColor(const int &layer) const
+{
+    return colors[layer % colors.size()];
+}
+
+quint32 SceneModifier::Tree::ChildSeed(quint32 seed, int index)
+{
+    //splitmix32 style finaliser so that sibling seeds are uncorrelated
+    quint32 h = seed + 0x9e3779b9u * quint32(index + 1);
+    h = (h ^ (h >> 16)) * 0x85ebca6bu;
+    h = (h ^ (h >> 13)) * 0xc2b2ae35u;
+    return h ^ (h >> 16);
 }
 
 void SceneModifier::Tree::GeneratePlaneSpheres(Node* const  par, const int &nodes, const int &layer)
@@ -280,7 +796,7 @@ void SceneModifier::Tree::GeneratePlaneSpheres(Node* const  par, const int &node
 
     for(size_t i = 0; i< candidates.size(); ++i)
     {
-         par->AddChild(candidates[i]);
+         Attach(par,candidates[i]);
     }
 }
 
@@ -317,11 +833,36 @@ bool SceneModifier::Tree::CollideOrExist(const SceneModifier::Node *const node,
     return false;
 }
 
-QVector<SceneModifier::Node *> SceneModifier::Tree::CreateCandidates(const Node * const par, const int& layer)
+bool SceneModifier::Tree::Collides(const SceneModifier::Node *const node)
 {
-    std::mt19937 gen;
-    gen.seed(std::random_device{}());
+    //a lazily expanded subtree must not depend on whatever else is loaded at the moment
+    if(scope != parent)
+        return CollideOrExist(node,scope) || SettledCollides(node);
+
+    if(IndexCollides(node))
+        return true;
+
+    for(auto it = neighbours.begin(); it != neighbours.end(); ++it)
+    {
+        if((*it)->NearBounds(node) && (*it)->IndexCollides(node))
+            return true;
+    }
+    return false;
+}
 
+bool SceneModifier::Tree::NearBounds(const SceneModifier::Node *const node) const
+{
+    for(int axis = 0; axis < 3; ++axis)
+    {
+        if(node->center[axis] + node->radius < boundsMin[axis] ||
+           node->center[axis] - node->radius > boundsMax[axis])
+            return false;
+    }
+    return true;
+}
+
+QVector<SceneModifier::Node *> SceneModifier::Tree::CreateCandidates(const Node * const par, const int& layer)
+{
     bool isplane = false;
     QVector<Node *> candidates;
     while(!isplane)
@@ -336,9 +877,9 @@ QVector<SceneModifier::Node *> SceneModifier::Tree::CreateCandidates(const Node
         while(candidates.size() < PLANESIZE)
         {
             QVector3D temp(xDistr(gen),yDistr(gen),zDistr(gen));
-            auto cand = new Node(temp,RADNODE,colors[layer]);
+            auto cand = new Node(temp,RADNODE,LayerColor(layer));
 
-            if(!CollideOrExist(cand,parent))
+            if(!Collides(cand))
             {
                 candidates.push_back(cand);
             }
@@ -365,8 +906,6 @@ QVector<SceneModifier::Node *> SceneModifier::Tree::CreateCandidates(const Node
 
 void SceneModifier::Tree::CreateRestOnes(Node * par,const int& nodes, QVector<Node *> & candidates,const int& layer)
 {
-    std::mt19937 gen;
-    gen.seed(std::random_device{}());
 
     auto A = candidates[0]->center;
     auto B = candidates[1]->center;
@@ -394,7 +933,7 @@ void SceneModifier::Tree::CreateRestOnes(Node * par,const int& nodes, QVector<No
             double x = ( -d - b*rand_y - c*rand_z) / a;
 
             QVector3D temp(x,rand_y, rand_z);
-            cand = new Node(temp,RADNODE,colors[layer]);
+            cand = new Node(temp,RADNODE,LayerColor(layer));
         }
         else if(c !=  0)
         {
@@ -403,7 +942,7 @@ void SceneModifier::Tree::CreateRestOnes(Node * par,const int& nodes, QVector<No
             double z = ( -d - a*rand_x - b*rand_y) / c;
 
             QVector3D temp(rand_x,rand_y, z);
-            cand = new Node(temp,RADNODE,colors[layer]);
+            cand = new Node(temp,RADNODE,LayerColor(layer));
         }
         else if(b !=  0)
         {
@@ -412,10 +951,10 @@ void SceneModifier::Tree::CreateRestOnes(Node * par,const int& nodes, QVector<No
             double y = ( -d - a*rand_x - c*rand_z) / b;
 
             QVector3D temp(rand_x,y, rand_z);
-            cand = new Node(temp,RADNODE,colors[layer]);
+            cand = new Node(temp,RADNODE,LayerColor(layer));
         }
 
-        if(!CollideOrExist(cand,parent))
+        if(!Collides(cand))
         {
             candidates.push_back(cand);
         }
@@ -444,3 +983,421 @@ void SceneModifier::Tree::GenerateNodes(const int layer, QVector<Node*>children)
     }
 
 }
+
+void SceneModifier::PackedTree::Begin(const Node * const root)
+{
+    static_assert(NMAX <= 0xffff, "child count must fit into PackedNode::childCount");
+
+    PackedNode packed;
+    packed.firstChild = 0;
+    packed.pos[0] = packed.pos[1] = packed.pos[2] = 0;
+    packed.childCount = 0;
+
+    nodes = QVector<PackedNode>() << packed;
+    origin = root->center;
+    boxMin = boxMax = QVector<QVector3D>() << QVector3D();
+    radii = QVector<float>() << root->radius;
+    maxError = 0;
+
+    frontier = QVector<QVector3D>() << origin;
+    frontierStart = 0;
+}
+
+void SceneModifier::PackedTree::AppendLayer(const QVector<Node *> &parents)
+{
+    // The layer is quantized relative to the already decoded parents,
+    // so the error of a node never adds up along its path to the root.
+    QVector3D lo(FLT_MAX,FLT_MAX,FLT_MAX);
+    QVector3D hi(-FLT_MAX,-FLT_MAX,-FLT_MAX);
+    const Node *first = nullptr;
+    for(int p = 0; p < parents.size(); ++p)
+    {
+        for(size_t i = 0; i < parents[p]->children.size(); ++i)
+        {
+            QVector3D offset = parents[p]->children[i]->center - frontier[p];
+            for(int axis = 0; axis < 3; ++axis)
+            {
+                lo[axis] = std::min(lo[axis], offset[axis]);
+                hi[axis] = std::max(hi[axis], offset[axis]);
+            }
+            first = parents[p]->children[i];
+        }
+    }
+
+    if(!first)
+        return;
+
+    const int layer = radii.size();
+    boxMin.push_back(lo);
+    boxMax.push_back(hi);
+    radii.push_back(first->radius);
+
+    const int start = nodes.size();
+    QVector<QVector3D> decoded;
+    for(int p = 0; p < parents.size(); ++p)
+    {
+        nodes[frontierStart + p].firstChild = nodes.size();
+        nodes[frontierStart + p].childCount = parents[p]->children.size();
+
+        for(size_t i = 0; i < parents[p]->children.size(); ++i)
+        {
+            const Node * const child = parents[p]->children[i];
+            QVector3D offset = child->center - frontier[p];
+
+            PackedNode packed;
+            packed.firstChild = 0;
+            packed.childCount = 0;
+            for(int axis = 0; axis < 3; ++axis)
+            {
+                float extent = hi[axis] - lo[axis];
+                packed.pos[axis] = extent > 0 ? qRound((offset[axis] - lo[axis]) / extent * 0xffff) : 0;
+            }
+            nodes.push_back(packed);
+
+            decoded.push_back(frontier[p] + Dequantize(packed,layer));
+            maxError = std::max(maxError, decoded.last().distanceToPoint(child->center));
+        }
+    }
+
+    frontier = decoded;
+    frontierStart = start;
+}
+
+void SceneModifier::PackedTree::End()
+{
+    frontier = QVector<QVector3D>();
+    nodes.squeeze();
+}
+
+void SceneModifier::PackedTree::Decode(RenderBatch *batch, const Tree &tree) const
+{
+    if(nodes.isEmpty())
+        return;
+
+    batch->Reserve(nodes.size(),nodes.size() - 1);
+    batch->AddSphere(origin,tree.LayerColor(0),radii[0]);
+
+    //breadth-first order stores every layer contiguously, so only the decoded parents are kept
+    QVector<QVector3D> parents;
+    parents.push_back(origin);
+    int start = 0;
+    int decoded = 0;
+    for(int layer = 1; !parents.isEmpty(); ++layer)
+    {
+        QVector<QVector3D> children;
+        for(int p = 0; p < parents.size(); ++p)
+        {
+            const PackedNode &node = nodes[start + p];
+            const quint32 last = node.firstChild + node.childCount;
+            for(quint32 c = node.firstChild; c < last; ++c)
+            {
+                children.push_back(parents[p] + Dequantize(nodes[c],layer));
+                batch->AddSphere(children.last(),tree.LayerColor(layer),radii[layer]);
+                batch->AddLine(parents[p],children.last());
+
+                //keep the staging copy small, the batch buffers are already sized for the whole tree
+                if(++decoded % DECODECHUNK == 0)
+                    batch->Commit();
+            }
+        }
+
+        start += parents.size();
+        parents = children;
+    }
+    batch->Commit();
+}
+
+QVector3D SceneModifier::PackedTree::Dequantize(const PackedNode &node, const int &layer) const
+{
+    QVector3D offset;
+    for(int axis = 0; axis < 3; ++axis)
+    {
+        float extent = boxMax[layer][axis] - boxMin[layer][axis];
+        offset[axis] = boxMin[layer][axis] + node.pos[axis] * extent / 0xffff;
+    }
+    return offset;
+}
+
+double SceneModifier::PackedTree::BytesPerNode() const
+{
+    if(nodes.isEmpty())
+        return 0;
+
+    double tables = boxMin.size() * 2 * sizeof(QVector3D) + radii.size() * sizeof(float);
+    return sizeof(PackedNode) + tables / nodes.size();
+}
+
+void SceneModifier::Tree::Generate()
+{
+    if(!relax)
+    {
+        GenerateRandNodes(1,parent);
+        GenerateNodes(2,parent->children);
+        return;
+    }
+
+    QVector<Node *> parents;
+    parents.push_back(parent);
+    for(int layer = 1; layer < L && !parents.isEmpty(); ++layer)
+    {
+        GenerateLayer(layer,parents);
+
+        QVector<Node *> next;
+        for(int i = 0; i < parents.size(); ++i)
+        {
+            next += parents[i]->children;
+        }
+        parents = next;
+    }
+}
+
+void SceneModifier::Tree::GenerateLayer(const int &layer, const QVector<Node *> &parents)
+{
+    if(relax)
+    {
+        RelaxLayer(layer,parents);
+        return;
+    }
+
+    for(int i = 0; i < parents.size(); ++i)
+    {
+        GenerateRandNodes(layer,parents[i]);
+    }
+}
+
+void SceneModifier::Tree::ReleaseLayer(const QVector<Node *> &nodes)
+{
+    //the children live on in the next layer, only the nodes themselves go
+    for(int i = 0; i < nodes.size(); ++i)
+    {
+        nodes[i]->children.clear();
+        if(nodes[i] == parent)
+            parent = scope = nullptr;
+        delete nodes[i];
+    }
+}
+
+void SceneModifier::Tree::RelaxLayer(const int &layer, const QVector<Node *> &parents)
+{
+    std::uniform_int_distribution<> dis(1, NMAX);
+
+    //a random point in the box GenerateRandNodes draws the children of par from
+    auto randomIn = [this](const Node * const par)
+    {
+        QVector3D translpoint(par->center.x(),par->center.y() - 30*par->radius,par->center.z() );
+
+        std::uniform_real_distribution<double> xDistr(translpoint.x() - 20*par->radius, translpoint.x() + 20*par->radius);
+        std::uniform_real_distribution<double> yDistr(translpoint.y() - 20*par->radius, translpoint.y() + 20*par->radius);
+        std::uniform_real_distribution<double> zDistr(translpoint.z() - 20*par->radius, translpoint.z() + 20*par->radius);
+        return QVector3D(xDistr(gen),yDistr(gen),zDistr(gen));
+    };
+
+    QVector<QVector3D> centers;
+    QVector<QVector3D> normals;
+    QVector<QVector3D> anchors;
+    QVector<int> owners;
+
+    //a fresh position for sphere i, on its plane when it has one
+    auto sample = [&](int i)
+    {
+        QVector3D temp = randomIn(parents[owners[i]]);
+        return temp - normals[i] * QVector3D::dotProduct(temp - anchors[i],normals[i]);
+    };
+
+    for(int p = 0; p < parents.size(); ++p)
+    {
+        const int nodes = dis(gen);
+
+        //more than PLANESIZE children share one plane, as in GeneratePlaneSpheres
+        QVector3D normal;
+        QVector3D anchor;
+        while(nodes > PLANESIZE && normal.isNull())
+        {
+            QVector3D A = randomIn(parents[p]);
+            QVector3D B = randomIn(parents[p]);
+            QVector3D C = randomIn(parents[p]);
+            normal = QVector3D(CalcA(A,B,C),CalcB(A,B,C),CalcC(A,B,C)).normalized();
+            anchor = A;
+        }
+
+        for(int i = 0; i < nodes; ++i)
+        {
+            normals.push_back(normal);
+            anchors.push_back(anchor);
+            owners.push_back(p);
+            centers.push_back(sample(centers.size()));
+        }
+    }
+
+    //spheres already placed do not move: the collision indices of this tree and its neighbours,
+    //or only the subtree being expanded when growing lazily
+    QHash<quint64, QVector<Sphere>> local;
+    QVector<const QHash<quint64, QVector<Sphere>> *> fixedGrids;
+    if(scope == parent)
+    {
+        fixedGrids.push_back(&index);
+        for(auto it = neighbours.begin(); it != neighbours.end(); ++it)
+        {
+            fixedGrids.push_back(&(*it)->index);
+        }
+    }
+    else
+    {
+        QVector<const Node *> subtree = settled;
+        CollectNodes(scope,subtree);
+        for(int i = 0; i < subtree.size(); ++i)
+        {
+            local[CellKey(subtree[i]->center,0,0,0)].push_back(Sphere{subtree[i]->center,subtree[i]->radius});
+        }
+        fixedGrids.push_back(&local);
+    }
+
+    QHash<quint64, QVector<int>> grid;
+    auto rebuild = [&]()
+    {
+        grid.clear();
+        for(int i = 0; i < centers.size(); ++i)
+        {
+            grid[CellKey(centers[i],0,0,0)].push_back(i);
+        }
+    };
+
+    // Depth of the worst overlap of sphere i, negative when it touches nothing, using the
+    // radius-sum test of Node::CheckCollide. With push set it also gets the move resolving it.
+    const QHash<quint64, QVector<int>>& movers = grid;
+    const QVector<const QHash<quint64, QVector<Sphere>> *>& fixedGridList = fixedGrids;
+    auto measure = [&](int i, QVector3D *push)
+    {
+        const QVector3D *pos = centers.constData();
+        QVector3D move;
+        float worst = -1;
+
+        for(int dx = -1; dx <= 1; ++dx)
+        for(int dy = -1; dy <= 1; ++dy)
+        for(int dz = -1; dz <= 1; ++dz)
+        {
+            const quint64 key = CellKey(pos[i],dx,dy,dz);
+
+            auto cell = movers.constFind(key);
+            if(cell != movers.constEnd())
+            {
+                for(int j : *cell)
+                {
+                    if(j == i)
+                        continue;
+                    QVector3D d = pos[i] - pos[j];
+                    float depth = 2*RADNODE - d.length();
+                    if(depth < 0)
+                        continue;
+                    QVector3D dir = d.isNull() ? QVector3D(i < j ? 1 : -1, 1, 1).normalized() : d.normalized();
+                    move += dir * (depth / 2 + RELAXSLACK);
+                    worst = std::max(worst,depth);
+                }
+            }
+
+            for(const QHash<quint64, QVector<Sphere>> *fixedGrid : fixedGridList)
+            {
+                auto fixed = fixedGrid->constFind(key);
+                if(fixed == fixedGrid->constEnd())
+                    continue;
+
+                for(const Sphere& sphere : *fixed)
+                {
+                    QVector3D d = pos[i] - sphere.center;
+                    float depth = RADNODE + sphere.radius - d.length();
+                    if(depth < 0)
+                        continue;
+                    QVector3D dir = d.isNull() ? QVector3D(0,-1,0) : d.normalized();
+                    move += dir * (depth + RELAXSLACK);
+                    worst = std::max(worst,depth);
+                }
+            }
+        }
+
+        //coplanar children may only slide within their plane
+        if(push)
+            *push = move - normals[i] * QVector3D::dotProduct(move,normals[i]);
+        return worst;
+    };
+
+    // Jacobi passes: every sphere reads the previous positions only. A layer holds at most
+    // NMAX^(L-1) spheres, far too few to pay for a thread pool dispatch per pass, so the cores
+    // are used one level up: GenerateForest relaxes the shards of a parity pass in parallel.
+    QVector<QVector3D> moves(centers.size());
+    QVector<float> overlaps(centers.size());
+
+    for(int pass = 0; pass < RELAXPASSES; ++pass)
+    {
+        rebuild();
+
+        for(int i = 0; i < centers.size(); ++i)
+        {
+            overlaps[i] = measure(i,&moves[i]);
+        }
+
+        if(overlaps.isEmpty() || *std::max_element(overlaps.constBegin(),overlaps.constEnd()) < 0)
+            break;
+
+        for(int i = 0; i < centers.size(); ++i)
+        {
+            centers[i] += moves[i];
+        }
+    }
+
+    //whatever still overlaps after the last move gets a bounded number of re-rolls and is
+    //dropped if none of them is free, so a crowded layer never spins
+    rebuild();
+    QVector<bool> placed(centers.size(),true);
+    for(int i = 0; i < centers.size(); ++i)
+    {
+        if(measure(i,nullptr) < 0)
+            continue;
+
+        grid[CellKey(centers[i],0,0,0)].removeOne(i);
+        placed[i] = false;
+        for(int retry = 0; retry < RELAXRETRIES && !placed[i]; ++retry)
+        {
+            centers[i] = sample(i);
+            placed[i] = measure(i,nullptr) < 0;
+        }
+
+        if(placed[i])
+            grid[CellKey(centers[i],0,0,0)].push_back(i);
+        else
+            ++dropped;
+    }
+
+    for(int i = 0; i < centers.size(); ++i)
+    {
+        if(placed[i])
+            Attach(parents[owners[i]],new Node(centers[i],RADNODE,LayerColor(layer)));
+    }
+
+    for(int p = 0; p < parents.size(); ++p)
+    {
+        AssignSeeds(parents[p],layer);
+    }
+}
+
+void SceneModifier::Tree::CollectNodes(const Node * const node, QVector<const Node *> &nodes) const
+{
+    nodes.push_back(node);
+    for(size_t i = 0; i < node->children.size(); ++i)
+    {
+        CollectNodes(node->children[i],nodes);
+    }
+}
+
+quint64 SceneModifier::Tree::CellKey(int x, int y, int z)
+{
+    //21 bits per axis, offset so that negative cells stay distinct
+    const quint64 mask = (1 << 21) - 1;
+    return (quint64(x + (1 << 20)) & mask) << 42 | (quint64(y + (1 << 20)) & mask) << 21 | (quint64(z + (1 << 20)) & mask);
+}
+
+quint64 SceneModifier::Tree::CellKey(const QVector3D &p, int dx, int dy, int dz)
+{
+    return CellKey(int(std::floor(p.x() / CELLSIZE)) + dx,
+                   int(std::floor(p.y() / CELLSIZE)) + dy,
+                   int(std::floor(p.z() / CELLSIZE)) + dz);
+}
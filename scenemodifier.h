@@ -52,6 +52,9 @@
 #define SCENEMODIFIER_H
 
 #include <QtCore/QObject>
+#include <QtCore/QVector>
+#include <QtCore/QHash>
+#include <QtCore/QElapsedTimer>
 
 #include <Qt3DCore/qentity.h>
 #include <Qt3DCore/qtransform.h>
@@ -65,26 +68,73 @@
 #include <Qt3DExtras/QPhongMaterial>
 #include<Qt3DRender/QMesh>
 
+#include <list>
+#include <random>
+
+#include "renderbatch.h"
+
+#ifdef HAVE_LIVEFEED
+class QProcess;
+class FeedRing;
+#endif
+
 
 class SceneModifier : public QObject
 {
     Q_OBJECT
 
 public:
-    explicit SceneModifier(Qt3DCore::QEntity *rootEntity);
+    enum Mode { SingleTree, Forest, LazyTree, CompactTree,
+#ifdef HAVE_LIVEFEED
+                LiveFeed
+#endif
+              };
+
+    explicit SceneModifier(Qt3DCore::QEntity *rootEntity, Mode mode = SingleTree, int trees = 1, bool relaxed = false);
     ~SceneModifier();
 
-public slots:
+    int ShardCount() const;
+    bool IsShardVisible(int shard) const;
+
+    //CompactTree statistics
+    int PackedNodeCount() const;
+    double PackedBytesPerNode() const;
+    double PointerBytesPerNode() const;
+    float PackedMaxError() const;
+
+    //spheres left out by the relaxation so far
+    int RelaxDropped() const;
+
+#ifdef HAVE_LIVEFEED
+    //entry point of the generator processes started by the LiveFeed mode
+    static int RunFeedWorker(const QString &spec);
+
+signals:
+    void FeedStats(double nodesPerSecond, double latencyFrames, quint64 stalls);
+#endif
 
+public slots:
+    void SetShardVisible(int shard, bool visible);
+    void SetAllShardsVisible(bool visible);
+    void UpdateCamera(const QVector3D &position);
+#ifdef HAVE_LIVEFEED
+    void IngestFeeds(float dt);
+#endif
 
 private:
     Qt3DCore::QEntity *m_rootEntity;
+    //the single tree keeps its Phong entities, the large modes instance when the context allows it
+    RenderBatch::Shared m_shared;
+    Mode m_mode;
     struct Node{
 
         QVector< Node *> children;
         QVector3D center;
         float radius;
         QColor colour;
+        //children are generated from this seed, so a collapsed subtree grows back identically
+        quint32 seed = 0;
+        int layer = 0;
 
         Node* AddChild(Node *child)
         {
@@ -117,15 +167,36 @@ private:
 
     class Tree {
     public:
-        Node * parent;
+        Node * parent = nullptr;
         QVector<QColor> colors;
         const int PLANESIZE = 3;
+        //trees of adjacent forest shards, checked only when a candidate reaches their bounds
+        QVector<const Tree *> neighbours;
+        QVector3D boundsMin;
+        QVector3D boundsMax;
+        //collision index: every sphere of the tree bucketed by its CELLSIZE grid cell,
+        //dropped by CompactTree once packing is done
+        struct Sphere { QVector3D center; float radius; };
+        QHash<quint64, QVector<Sphere>> index;
+        //subtree new candidates are checked against, the whole tree unless expanding lazily
+        Node * scope = nullptr;
+        //spheres every lazy expansion below them can rely on: the root and the children of each
+        //ancestor, which regenerate identically; subtrees of cousins come and go and are not checked
+        QVector<const Node *> settled;
+        std::mt19937 gen;
+        //place a whole layer at once and push overlapping spheres apart instead of re-rolling them
+        bool relax = false;
+        //spheres the relaxation could neither separate nor re-roll into a free spot
+        int dropped = 0;
     public:
         Tree();
         ~Tree();
         Tree(Node root,QVector< Node *> child);
         void SetParent(Node *root);
-        void Draw(SceneModifier *const, QVector<Node *> children, Node *parent);
+        void Draw(RenderBatch *batch, const Node * const node);
+        void Attach(Node * const par, Node * const child);
+        void Index(const Node * const node);
+        bool IndexCollides(const Node * const node) const;
         void GenerateRandNodes(int layer,Node * par);
         void GenerateNodes(const int layer,QVector<Node*>children);
         void CreateColors();
@@ -138,15 +209,115 @@ private:
         double CalcC(const QVector3D& A, const QVector3D& B, const QVector3D& C);
         double CalcD(const QVector3D& A, const double &a, const double &b, const double &c);
         bool CollideOrExist(const Node* const node, Node * const inner);
+        bool Collides(const Node* const node);
+        bool NearBounds(const Node* const node) const;
+        void Expand(Node * const node, const QVector<const Node *>& ancestors);
+        bool SettledCollides(const Node * const node) const;
+        void Generate();
+        void GenerateLayer(const int& layer, const QVector<Node *>& parents);
+        void ReleaseLayer(const QVector<Node *>& nodes);
+        void RelaxLayer(const int& layer, const QVector<Node *>& parents);
+        void AssignSeeds(Node * const par, const int& layer);
+        void CollectNodes(const Node * const node, QVector<const Node *>& nodes) const;
+        static quint64 CellKey(int x, int y, int z);
+        static quint64 CellKey(const QVector3D& p, int dx, int dy, int dz);
+        QColor LayerColor(const int& layer) const;
+        static quint32 ChildSeed(quint32 seed, int index);
     } spheres;
 
+    //one independent tree per forest cell with its own collision index and render batch
+    struct Shard {
+        Tree tree;
+        RenderBatch *batch;
+        int row;
+        int col;
+    };
+    QVector<Shard *> m_shards;
+
+    //breadth-first quantized copy of a tree, the children of a node are stored contiguously
+    class PackedTree {
+    public:
+        struct PackedNode {
+            quint32 firstChild;
+            //offset from the decoded parent, quantized over the layer's box
+            quint16 pos[3];
+            quint16 childCount;
+        };
+        QVector<PackedNode> nodes;
+        QVector3D origin;
+        //per layer: box of child offsets and the shared sphere radius, colours come from Tree::colors
+        QVector<QVector3D> boxMin;
+        QVector<QVector3D> boxMax;
+        QVector<float> radii;
+        float maxError = 0;
+        //decoded centres of the newest layer while the tree is being built
+        QVector<QVector3D> frontier;
+        int frontierStart = 0;
+    public:
+        void Begin(const Node * const root);
+        void AppendLayer(const QVector<Node *>& parents);
+        void End();
+        void Decode(RenderBatch *batch, const Tree &tree) const;
+        QVector3D Dequantize(const PackedNode& node, const int& layer) const;
+        double BytesPerNode() const;
+    } m_packed;
+
+    //lazily expanded nodes and the slots holding their children, in m_lru most recently used
+    //first; a node is always touched after its expanded descendants, so the tail is a leaf
+    struct Expansion {
+        int slot;
+        std::list<Node *>::iterator lru;
+        qint64 bytes;
+        quint64 touched;
+    };
+    QHash<Node *, Expansion> m_expanded;
+    std::list<Node *> m_lru;
+    qint64 m_lazyBytes = 0;
+    quint64 m_update = 0;
+    //one batch for the whole lazy tree: the root, then NMAX spheres and lines per slot;
+    //collapsed expansions hide their slot and hand it back for the next one
+    RenderBatch *m_lazyBatch = nullptr;
+    QVector<int> m_freeSlots;
+    int m_slots = 0;
+
+#ifdef HAVE_LIVEFEED
+    //one ring and one generator process per worker, drained once per frame
+    QVector<FeedRing *> m_feeds;
+    QVector<RenderBatch *> m_feedBatches;
+    int m_nextFeed = 0;
+    QVector<QProcess *> m_workers;
+    quint64 m_frame = 0;
+    quint64 m_ingested = 0;
+    quint64 m_latency = 0;
+    QElapsedTimer m_statsTimer;
+#endif
+
     static constexpr int NMAX = 5;
     static constexpr int L = 3;
     static constexpr float RADNODE = 0.1;
     static constexpr float RADROOT = 0.3;
+    static constexpr float SHARDSIZE = 20;
+    //no two spheres further apart than one cell can touch
+    static constexpr float CELLSIZE = RADROOT + RADNODE;
+    static constexpr float EXPANDDIST = 12;
+    static constexpr qint64 LAZYBUDGET = 64ll * 1024 * 1024;
+    static constexpr int RELAXPASSES = 32;
+    static constexpr float RELAXSLACK = 0.001;
+    static constexpr int RELAXRETRIES = 64;
+    static constexpr quint32 FEEDCAPACITY = 1 << 16;
+    //per frame the viewer spends up to FEEDSLICE ns ingesting, a quarter of a 60 fps frame
+    static constexpr qint64 FEEDSLICE = 4000000;
+    static constexpr quint32 FEEDCHUNK = 1024;
+    static constexpr int DECODECHUNK = 4096;
 private:
-    void DrawLine(const QVector3D&,const QVector3D& );
-    void DrawSphere(const QVector3D& ,QColor,float );
+#ifdef HAVE_LIVEFEED
+    void StartFeed(int trees, bool relaxed);
+    static bool PublishTree(FeedRing *feed, const Node * const node, const Node * const parent);
+#endif
+    void GenerateForest(int trees, bool relaxed);
+    bool ExpandNear(Node *node, const QVector3D &position, QVector<const Node *> &ancestors);
+    void Collapse(Node *node);
+    int AcquireSlot();
 
 };
 